@@ -0,0 +1,25 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#include "bus.h"
+
+void BusCheckFailed( uint32_t ofs, uint32_t len, int write )
+{
+	fprintf( stderr, "bus: %s of %u bytes at RAM offset %08x is outside RAM (%08x bytes)\n", write ? "store" : "load", len, ofs, ram_amt );
+	abort();
+}
+
+void BusTrace( const char * what, uint32_t addr, uint32_t val )
+{
+	fprintf( stderr, "bus: %-6s %08x %08x\n", what, addr, val );
+}
+
+void MiniRV32IMAAttachRam( uint8_t * image, uint32_t size )
+{
+	uint32_t npages = ( size + BUS_PAGE_MASK ) >> BUS_PAGE_SHIFT;
+	free( PagedBus::pages );
+	PagedBus::pages = (uint8_t **)malloc( npages * sizeof( uint8_t * ) );
+	for( uint32_t i = 0; i < npages; i++ )
+		PagedBus::pages[i] = image + ( i << BUS_PAGE_SHIFT );
+}
@@ -0,0 +1,119 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef BUS_H
+#define BUS_H
+
+#include "core.h"
+
+// # 访存策略 (bus policy): 预解码引擎的 step 模板通过 Config::Bus 做所有 RAM 读写 / MMIO 判断 / MMIO 调出,
+// # 换内存布局或者加调试检查只需要换一个 Bus 类型, 不用改 step 本身.
+// # ofs 是 RAM 内偏移 (guest 地址 - MINIRV32_RAM_IMAGE_OFFSET), 调用前 step 已经检查过范围;
+// # addr 是 guest 物理地址, 只用于 MMIO.
+// #
+// #   FlatBus			就是 hook.h 里的 MINIRV32_* 宏, 生成的代码与以前相同 (也跟着 MINIRV32_CUSTOM_MEMORY_BUS 走)
+// #   CheckedBus		每次访问再按 ram_amt 检查一遍, 越界时打印并 abort, 用来查 step 的边界检查
+// #   TracingBus<B>	把每次访问打到 stderr, 再交给 B
+// #   PagedBus			经 4KiB 页表间接访问, 页可以不连续 (页表由 MiniRV32IMAAttachRam 建立)
+// #   GuardBus			guard 模式 (guard.h): 直接访问 base + guest 地址, 越界由 SIGSEGV 兜底, step 里不做范围比较
+
+struct FlatBus
+{
+	static constexpr bool kGuarded = false;	// # true 时 step 省掉 RAM 范围检查
+
+	static inline uint32_t load4( uint8_t * image, uint32_t ofs ) { return MINIRV32_LOAD4( ofs ); }
+	static inline uint32_t load2( uint8_t * image, uint32_t ofs ) { return MINIRV32_LOAD2( ofs ); }
+	static inline uint32_t load1( uint8_t * image, uint32_t ofs ) { return MINIRV32_LOAD1( ofs ); }
+	static inline uint32_t load2s( uint8_t * image, uint32_t ofs ) { return MINIRV32_LOAD2_SIGNED( ofs ); }
+	static inline uint32_t load1s( uint8_t * image, uint32_t ofs ) { return MINIRV32_LOAD1_SIGNED( ofs ); }
+	static inline void store4( uint8_t * image, uint32_t ofs, uint32_t val ) { MINIRV32_STORE4( ofs, val ); }
+	static inline void store2( uint8_t * image, uint32_t ofs, uint32_t val ) { MINIRV32_STORE2( ofs, val ); }
+	static inline void store1( uint8_t * image, uint32_t ofs, uint32_t val ) { MINIRV32_STORE1( ofs, val ); }
+
+	static inline bool mmio( uint32_t addr ) { return MINIRV32_MMIO_RANGE( addr ); }
+	static inline uint32_t control_load( uint32_t addr ) { return HandleControlLoad( addr ); }
+	// # 返回非 0 时 step 要带着 val 返回 (syscon)
+	static inline uint32_t control_store( uint32_t addr, uint32_t val ) { return HandleControlStore( addr, val ); }
+};
+
+void BusCheckFailed( uint32_t ofs, uint32_t len, int write );
+
+struct CheckedBus : FlatBus
+{
+	static inline void check( uint32_t ofs, uint32_t len, int write ) { if( ofs > ram_amt - len ) BusCheckFailed( ofs, len, write ); }
+
+	static inline uint32_t load4( uint8_t * image, uint32_t ofs ) { check( ofs, 4, 0 ); return FlatBus::load4( image, ofs ); }
+	static inline uint32_t load2( uint8_t * image, uint32_t ofs ) { check( ofs, 2, 0 ); return FlatBus::load2( image, ofs ); }
+	static inline uint32_t load1( uint8_t * image, uint32_t ofs ) { check( ofs, 1, 0 ); return FlatBus::load1( image, ofs ); }
+	static inline uint32_t load2s( uint8_t * image, uint32_t ofs ) { check( ofs, 2, 0 ); return FlatBus::load2s( image, ofs ); }
+	static inline uint32_t load1s( uint8_t * image, uint32_t ofs ) { check( ofs, 1, 0 ); return FlatBus::load1s( image, ofs ); }
+	static inline void store4( uint8_t * image, uint32_t ofs, uint32_t val ) { check( ofs, 4, 1 ); FlatBus::store4( image, ofs, val ); }
+	static inline void store2( uint8_t * image, uint32_t ofs, uint32_t val ) { check( ofs, 2, 1 ); FlatBus::store2( image, ofs, val ); }
+	static inline void store1( uint8_t * image, uint32_t ofs, uint32_t val ) { check( ofs, 1, 1 ); FlatBus::store1( image, ofs, val ); }
+};
+
+void BusTrace( const char * what, uint32_t addr, uint32_t val );
+
+template< class Inner >
+struct TracingBus
+{
+	static constexpr bool kGuarded = false;
+
+	static inline uint32_t traced( const char * what, uint32_t ofs, uint32_t val ) { BusTrace( what, ofs + MINIRV32_RAM_IMAGE_OFFSET, val ); return val; }
+
+	static inline uint32_t load4( uint8_t * image, uint32_t ofs ) { return traced( "lw", ofs, Inner::load4( image, ofs ) ); }
+	static inline uint32_t load2( uint8_t * image, uint32_t ofs ) { return traced( "lhu", ofs, Inner::load2( image, ofs ) ); }
+	static inline uint32_t load1( uint8_t * image, uint32_t ofs ) { return traced( "lbu", ofs, Inner::load1( image, ofs ) ); }
+	static inline uint32_t load2s( uint8_t * image, uint32_t ofs ) { return traced( "lh", ofs, Inner::load2s( image, ofs ) ); }
+	static inline uint32_t load1s( uint8_t * image, uint32_t ofs ) { return traced( "lb", ofs, Inner::load1s( image, ofs ) ); }
+	static inline void store4( uint8_t * image, uint32_t ofs, uint32_t val ) { traced( "sw", ofs, val ); Inner::store4( image, ofs, val ); }
+	static inline void store2( uint8_t * image, uint32_t ofs, uint32_t val ) { traced( "sh", ofs, val & 0xffff ); Inner::store2( image, ofs, val ); }
+	static inline void store1( uint8_t * image, uint32_t ofs, uint32_t val ) { traced( "sb", ofs, val & 0xff ); Inner::store1( image, ofs, val ); }
+
+	static inline bool mmio( uint32_t addr ) { return Inner::mmio( addr ); }
+	static inline uint32_t control_load( uint32_t addr ) { uint32_t v = Inner::control_load( addr ); BusTrace( "mmio-r", addr, v ); return v; }
+	static inline uint32_t control_store( uint32_t addr, uint32_t val ) { BusTrace( "mmio-w", addr, val ); return Inner::control_store( addr, val ); }
+};
+
+#define BUS_PAGE_SHIFT	12
+#define BUS_PAGE_MASK	( ( 1u << BUS_PAGE_SHIFT ) - 1 )
+
+struct PagedBus : FlatBus
+{
+	static inline uint8_t ** pages;		// # 每个 guest 页在主机上的地址
+
+	static inline uint8_t * at( uint32_t ofs ) { return pages[ofs >> BUS_PAGE_SHIFT] + ( ofs & BUS_PAGE_MASK ); }
+	// # 只有跨页的非对齐访问需要拆成字节
+	static inline bool split( uint32_t ofs, uint32_t len ) { return ( ofs & BUS_PAGE_MASK ) > BUS_PAGE_MASK + 1 - len; }
+	static inline uint32_t bytes( uint32_t ofs, uint32_t len ) { uint32_t v = 0; for( uint32_t i = 0; i < len; i++ ) v |= (uint32_t)*at( ofs + i ) << ( 8 * i ); return v; }
+	static inline void put_bytes( uint32_t ofs, uint32_t len, uint32_t val ) { for( uint32_t i = 0; i < len; i++ ) *at( ofs + i ) = val >> ( 8 * i ); }
+
+	static inline uint32_t load4( uint8_t * image, uint32_t ofs ) { return split( ofs, 4 ) ? bytes( ofs, 4 ) : *(uint32_t *)at( ofs ); }
+	static inline uint32_t load2( uint8_t * image, uint32_t ofs ) { return split( ofs, 2 ) ? bytes( ofs, 2 ) : *(uint16_t *)at( ofs ); }
+	static inline uint32_t load1( uint8_t * image, uint32_t ofs ) { return *at( ofs ); }
+	static inline uint32_t load2s( uint8_t * image, uint32_t ofs ) { return (int16_t)load2( image, ofs ); }
+	static inline uint32_t load1s( uint8_t * image, uint32_t ofs ) { return (int8_t)*at( ofs ); }
+	static inline void store4( uint8_t * image, uint32_t ofs, uint32_t val ) { if( split( ofs, 4 ) ) put_bytes( ofs, 4, val ); else *(uint32_t *)at( ofs ) = val; }
+	static inline void store2( uint8_t * image, uint32_t ofs, uint32_t val ) { if( split( ofs, 2 ) ) put_bytes( ofs, 2, val ); else *(uint16_t *)at( ofs ) = val; }
+	static inline void store1( uint8_t * image, uint32_t ofs, uint32_t val ) { *at( ofs ) = val; }
+};
+
+// # image 指向保留区里的 RAM 起点; guest 地址是 32 位的, 所以 base + 地址一定落在 4GiB 保留区内
+struct GuardBus : FlatBus
+{
+	static constexpr bool kGuarded = true;
+
+	static inline uint8_t * at( uint8_t * image, uint32_t ofs ) { return (uint8_t *)( (uintptr_t)image - MINIRV32_RAM_IMAGE_OFFSET ) + (uint32_t)( ofs + MINIRV32_RAM_IMAGE_OFFSET ); }
+
+	static inline uint32_t load4( uint8_t * image, uint32_t ofs ) { return *(uint32_t *)at( image, ofs ); }
+	static inline uint32_t load2( uint8_t * image, uint32_t ofs ) { return *(uint16_t *)at( image, ofs ); }
+	static inline uint32_t load1( uint8_t * image, uint32_t ofs ) { return *at( image, ofs ); }
+	static inline uint32_t load2s( uint8_t * image, uint32_t ofs ) { return *(int16_t *)at( image, ofs ); }
+	static inline uint32_t load1s( uint8_t * image, uint32_t ofs ) { return *(int8_t *)at( image, ofs ); }
+	static inline void store4( uint8_t * image, uint32_t ofs, uint32_t val ) { *(uint32_t *)at( image, ofs ) = val; }
+	static inline void store2( uint8_t * image, uint32_t ofs, uint32_t val ) { *(uint16_t *)at( image, ofs ) = val; }
+	static inline void store1( uint8_t * image, uint32_t ofs, uint32_t val ) { *at( image, ofs ) = val; }
+};
+
+#endif //BUS_H
@@ -0,0 +1,11 @@
+//
+// Created by liujilan on 25-10-19.
+//
+
+// # 基于预解码缓存的解释器, 所有指令共享一个 switch 分发
+#define DECODED_STEP_NAME		DecodedStep
+#define DECODED_STEP_THREADED	0
+#include "decoded_step.h"
+
+STEP_INSTANTIATE( decoded, DecodedStep )
+STEP_INSTANTIATE_GUARD( decoded, DecodedStep )
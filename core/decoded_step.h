@@ -0,0 +1,515 @@
+//
+// Created by liujilan on 25-10-19.
+//
+
+// # 预解码引擎的 step 函数模板, 语义与 old_core.c 的 MiniRV32IMAStep 完全一致.
+// # 模板参数是 step_config.h 里的 StepConfig; 各引擎的 .cpp 包含本文件后用 STEP_INSTANTIATE 实例化.
+// # 包含前需要定义:
+// #   DECODED_STEP_NAME		函数模板名 (在 step_config.h 里声明过)
+// #   DECODED_STEP_THREADED	1 = 每个 handler 末尾自带一次间接跳转 (GCC labels-as-values)
+// #							0 = 所有指令共享一个 switch
+// #
+// # guest 寄存器一直留在 state->regs 里. 试过在 step 入口拷进局部数组、退出时写回: 数组按解码出的寄存器号
+// # 动态下标, 编译器照样把它放在栈上, 每条指令的读写一次没少, threaded 反而从 245-257 掉到 225-238 MIPS;
+// # 给 state / image 加 __restrict 也测不出差别.
+// #
+// # 顺序执行时只是 e++, 跳转到本页内时直接算出条目指针, 只有跨页或跳出本页时才重新检查 PC 并查页表.
+// # 解码器标出的融合指令对 (见 DecodeFusePairs) 在一个 handler 里执行完两条, 省掉一次分发.
+
+#include "core.h"
+#include "decoder.h"
+#include "step_config.h"
+#include "guard.h"
+
+// # RAM 大小和陷入策略取自 Config, 不再读 ram_amt / fail_on_all_faults
+#undef MINI_RV32_RAM_SIZE
+#define MINI_RV32_RAM_SIZE	Config::ram_size()
+#define STEP_POSTEXEC( ir, retval ) \
+	{ if( retval > 0 ) { if( Config::kFault == FAULT_STOP ) { printf( "FAULT\n" ); return 3; } else retval = HandleException( ir, retval ); } }
+#define TRACE()				{ if( Config::kTrace ) DecodedTrace( image, pc, d ); }
+
+#if DECODED_STEP_THREADED
+	#define OP( name )		op_##name:
+	#define NEXT			{ pc = npc; if( icount >= count ) goto out; icount++; cycle++; if( e == e_end ) goto refetch; d = e++; TRACE(); npc = pc + 4; goto *dispatch[d->op]; }
+#else
+	#define OP( name )		case DOP_##name:
+	#define NEXT			{ pc = npc; goto top; }
+#endif
+
+// # 跳转目标仍在本页内时直接算出条目指针, 否则下一条重新查页
+#define JUMP( target )		{ npc = ( target ); if( ( ( npc ^ pc ) >> DECODE_PAGE_SHIFT ) == 0 && !( npc & 3 ) ) e = d + ( (int32_t)( npc - pc ) >> 2 ); else e = e_end = 0; NEXT }
+#define TRAP( t )			{ trap = ( t ); goto trapped; }
+#define BRANCH( cond )		{ if( cond ) JUMP( pc + d->imm ) NEXT }
+
+// # 融合 handler 执行完第一条后调用: 计入第二条, 把 d / pc 移到第二条, 之后按第二条的语义继续.
+// # 调用前要确认还有预算 (icount < count); 只剩一条时 (包括 -s 单步) 只执行第一条,
+// # 第二条下次照常按自己的条目执行. 陷入时 pc 指向第二条, 与不融合时一致.
+#define FUSE_SECOND			{ decoded_fuse_hits[d->op]++; pc = npc; icount++; cycle++; d = e++; TRACE(); npc = pc + 4; }
+
+// # 比较 + beqz / bnez
+#define CMP_BRANCH( name, cmp ) \
+	OP( name ) \
+	{ \
+		uint32_t c = ( cmp ); \
+		REGSET( d->rd, c ); \
+		if( icount < count ) { FUSE_SECOND; BRANCH( ( d->op == DOP_BNE ) == ( c != 0 ) ) } \
+	} NEXT
+
+// # guard 模式下不检查范围, 访存前记下当前指令; 越界时 SIGSEGV 把控制带回 GuardEnter, 再从这条接着执行.
+// # 编译器屏障保证此前的寄存器写回已经落到 state 里.
+#define GUARD_MARK()		{ guard_ctx.pc = pc; guard_ctx.icount = icount; asm volatile( "" :: "m"( *state ) ); }
+
+// # 每种宽度的访存各自一个 handler; RAM 之外的地址走 MMIO 或访问异常. 具体读写都经过 Config::Bus (bus.h)
+#define LOAD( name, load )	OP( name ) LOAD_BODY( load )
+#define LOAD_BODY( load ) \
+	{ \
+		uint32_t rsval = REG( d->rs1 ) + d->imm - MINIRV32_RAM_IMAGE_OFFSET; \
+		if constexpr( Bus::kGuarded ) \
+		{ \
+			GUARD_MARK(); \
+			rval = Bus::load( image, rsval ); \
+		} \
+		else if( rsval >= MINI_RV32_RAM_SIZE-3 ) \
+		{ \
+			rsval += MINIRV32_RAM_IMAGE_OFFSET; \
+			if( !Bus::mmio( rsval ) ) { rval = rsval; TRAP( 5+1 ) } \
+			rval = Bus::control_load( rsval ); \
+			MINIRV32_MMIO_YIELD( count ); \
+		} \
+		else \
+			rval = Bus::load( image, rsval ); \
+		if( d->rd ) REGSET( d->rd, rval ); \
+	} NEXT
+
+// # 写到了已解码的页(可能就是当前页)时, 之后重新查页
+#define STORE( name, store, len ) \
+	OP( name ) \
+	{ \
+		uint32_t rs2 = REG( d->rs2 ); \
+		uint32_t addy = REG( d->rs1 ) + d->imm - MINIRV32_RAM_IMAGE_OFFSET; \
+		if constexpr( Bus::kGuarded ) \
+		{ \
+			GUARD_MARK(); \
+			Bus::store( image, addy, rs2 ); \
+			if( DecodedNotifyStore( addy, len ) ) e = e_end = 0; \
+		} \
+		else if( addy >= MINI_RV32_RAM_SIZE-3 ) \
+		{ \
+			addy += MINIRV32_RAM_IMAGE_OFFSET; \
+			if( !Bus::mmio( addy ) ) { rval = addy; TRAP( 7+1 ) } \
+			if( Bus::control_store( addy, rs2 ) ) return rs2; \
+			MINIRV32_MMIO_YIELD( count ); \
+		} \
+		else \
+		{ \
+			Bus::store( image, addy, rs2 ); \
+			if( DecodedNotifyStore( addy, len ) ) e = e_end = 0; \
+		} \
+	} NEXT
+
+template< class Config >
+int32_t DECODED_STEP_NAME( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count )
+{
+	typedef typename Config::Bus Bus;
+
+	// # guard 模式下出错后由 GuardEnter 重新调用进来: 这一片开头已经处理过时间和中断, 直接接着执行
+	bool resume = Bus::kGuarded && guard_ctx.resume;
+	if( !resume )
+	{
+		uint32_t new_timer = CSR( timerl ) + elapsedUs;
+		if( new_timer < CSR( timerl ) ) CSR( timerh )++;
+		CSR( timerl ) = new_timer;
+
+		// Handle Timer interrupt.
+		if( ( CSR( timerh ) > CSR( timermatchh ) || ( CSR( timerh ) == CSR( timermatchh ) && CSR( timerl ) > CSR( timermatchl ) ) ) && ( CSR( timermatchh ) || CSR( timermatchl ) ) )
+		{
+			CSR( extraflags ) &= ~4; // Clear WFI
+			CSR( mip ) |= 1<<7; //MTIP of MIP // https://stackoverflow.com/a/61916199/2926815  Fire interrupt.
+		}
+		else
+			CSR( mip ) &= ~(1<<7);
+
+		// # MEIP 由 shell 按 PLIC 的状态维护, 挂着时同样唤醒 WFI
+		if( CSR( mip ) & (1<<11) )
+			CSR( extraflags ) &= ~4;
+
+		// If WFI, don't run processor.
+		if( CSR( extraflags ) & 4 )
+			return 1;
+	}
+
+	uint32_t trap = 0;
+	uint32_t rval = 0;
+	uint32_t pc = CSR( pc );
+	uint32_t cycle = CSR( cyclel );
+
+	uint32_t irq = CSR( mip ) & CSR( mie ) & ( (1<<11) | (1<<7) );	// # MEIE / MTIE
+	if( !resume && irq && ( CSR( mstatus ) & 0x8 /*mie*/) )
+	{
+		// # 外部中断 (PLIC) 优先于定时器中断
+		trap = ( irq & (1<<11) ) ? 0x8000000b : 0x80000007;
+		pc -= 4;
+	}
+	else // No timer interrupt?  Execute a bunch of instructions.
+	{
+#if DECODED_STEP_THREADED
+		static void * const dispatch[DOP_COUNT] = {
+#define DECODED_OP_LABEL( name ) &&op_##name,
+			DECODED_OPS( DECODED_OP_LABEL )
+#undef DECODED_OP_LABEL
+		};
+#endif
+		const struct DecodedInsn * e = 0;		// # 当前指令在解码页中的位置
+		const struct DecodedInsn * e_end = 0;	// # 当前解码页的尾后, e == e_end 时重新查页
+		const struct DecodedInsn * d = 0;		// # 正在执行的指令
+		uint32_t npc = pc;						// # 顺序执行时的下一条 pc
+		int icount = 0;
+
+		if constexpr( Bus::kGuarded )
+		{
+			// # 上面这些局部变量都按 guard_ctx 重新设置, 出错那条走慢路径重做
+			if( resume )
+			{
+				guard_ctx.resume = 0;
+				pc = guard_ctx.pc;
+				icount = guard_ctx.icount;
+				cycle = CSR( cyclel ) + icount;
+				e = e_end = 0;
+				int r = GuardSlowAccess( state, image, pc, &rval );
+				if( r < 0 ) return rval;	// syscon
+				if( r > 0 ) TRAP( r )
+				MINIRV32_MMIO_YIELD( count );
+				npc = pc + 4;
+				NEXT
+			}
+		}
+
+#if !DECODED_STEP_THREADED
+	top:
+#endif
+		if( icount >= count ) goto out;
+		icount++;
+		cycle++;
+		if( e == e_end ) goto refetch;
+
+	decoded:
+		d = e++;
+		TRACE();
+		npc = pc + 4;
+#if DECODED_STEP_THREADED
+		goto *dispatch[d->op];
+#else
+		switch( d->op )
+		{
+#endif
+
+		OP( NOP ) NEXT
+		OP( LUI ) { REGSET( d->rd, d->imm ); } NEXT
+		OP( AUIPC ) { REGSET( d->rd, pc + d->imm ); } NEXT
+
+		OP( ADDI ) { REGSET( d->rd, REG( d->rs1 ) + d->imm ); } NEXT
+		OP( SLTI ) { REGSET( d->rd, (int32_t)REG( d->rs1 ) < d->imm ); } NEXT
+		OP( SLTIU ) { REGSET( d->rd, REG( d->rs1 ) < (uint32_t)d->imm ); } NEXT
+		OP( XORI ) { REGSET( d->rd, REG( d->rs1 ) ^ d->imm ); } NEXT
+		OP( ORI ) { REGSET( d->rd, REG( d->rs1 ) | d->imm ); } NEXT
+		OP( ANDI ) { REGSET( d->rd, REG( d->rs1 ) & d->imm ); } NEXT
+		OP( SLLI ) { REGSET( d->rd, REG( d->rs1 ) << d->imm ); } NEXT
+		OP( SRLI ) { REGSET( d->rd, REG( d->rs1 ) >> d->imm ); } NEXT
+		OP( SRAI ) { REGSET( d->rd, (int32_t)REG( d->rs1 ) >> d->imm ); } NEXT
+
+		OP( ADD ) { REGSET( d->rd, REG( d->rs1 ) + REG( d->rs2 ) ); } NEXT
+		OP( SUB ) { REGSET( d->rd, REG( d->rs1 ) - REG( d->rs2 ) ); } NEXT
+		OP( SLL ) { REGSET( d->rd, REG( d->rs1 ) << ( REG( d->rs2 ) & 0x1f ) ); } NEXT
+		OP( SLT ) { REGSET( d->rd, (int32_t)REG( d->rs1 ) < (int32_t)REG( d->rs2 ) ); } NEXT
+		OP( SLTU ) { REGSET( d->rd, REG( d->rs1 ) < REG( d->rs2 ) ); } NEXT
+		OP( XOR ) { REGSET( d->rd, REG( d->rs1 ) ^ REG( d->rs2 ) ); } NEXT
+		OP( SRL ) { REGSET( d->rd, REG( d->rs1 ) >> ( REG( d->rs2 ) & 0x1f ) ); } NEXT
+		OP( SRA ) { REGSET( d->rd, (int32_t)REG( d->rs1 ) >> ( REG( d->rs2 ) & 0x1f ) ); } NEXT
+		OP( OR ) { REGSET( d->rd, REG( d->rs1 ) | REG( d->rs2 ) ); } NEXT
+		OP( AND ) { REGSET( d->rd, REG( d->rs1 ) & REG( d->rs2 ) ); } NEXT
+
+		OP( MUL ) { REGSET( d->rd, REG( d->rs1 ) * REG( d->rs2 ) ); } NEXT
+		OP( MULH ) { REGSET( d->rd, ((int64_t)((int32_t)REG( d->rs1 )) * (int64_t)((int32_t)REG( d->rs2 ))) >> 32 ); } NEXT
+		OP( MULHSU ) { REGSET( d->rd, ((int64_t)((int32_t)REG( d->rs1 )) * (uint64_t)REG( d->rs2 )) >> 32 ); } NEXT
+		OP( MULHU ) { REGSET( d->rd, ((uint64_t)REG( d->rs1 ) * (uint64_t)REG( d->rs2 )) >> 32 ); } NEXT
+		OP( DIV )
+		{
+			uint32_t rs1 = REG( d->rs1 ), rs2 = REG( d->rs2 );
+			if( rs2 == 0 ) rval = -1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? rs1 : ((int32_t)rs1 / (int32_t)rs2);
+			REGSET( d->rd, rval );
+		} NEXT
+		OP( DIVU )
+		{
+			uint32_t rs1 = REG( d->rs1 ), rs2 = REG( d->rs2 );
+			if( rs2 == 0 ) rval = 0xffffffff; else rval = rs1 / rs2;
+			REGSET( d->rd, rval );
+		} NEXT
+		OP( REM )
+		{
+			uint32_t rs1 = REG( d->rs1 ), rs2 = REG( d->rs2 );
+			if( rs2 == 0 ) rval = rs1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? 0 : ((uint32_t)((int32_t)rs1 % (int32_t)rs2));
+			REGSET( d->rd, rval );
+		} NEXT
+		OP( REMU )
+		{
+			uint32_t rs1 = REG( d->rs1 ), rs2 = REG( d->rs2 );
+			if( rs2 == 0 ) rval = rs1; else rval = rs1 % rs2;
+			REGSET( d->rd, rval );
+		} NEXT
+
+		OP( JAL )
+		{
+			if( d->rd ) REGSET( d->rd, pc + 4 );
+			JUMP( pc + d->imm )
+		}
+		OP( JALR ) fuse_JALR:
+		{
+			uint32_t target = ( REG( d->rs1 ) + d->imm ) & ~1;
+			if( d->rd ) REGSET( d->rd, pc + 4 );
+			JUMP( target )
+		}
+
+		OP( BEQ ) BRANCH( REG( d->rs1 ) == REG( d->rs2 ) )
+		OP( BNE ) BRANCH( REG( d->rs1 ) != REG( d->rs2 ) )
+		OP( BLT ) BRANCH( (int32_t)REG( d->rs1 ) < (int32_t)REG( d->rs2 ) )
+		OP( BGE ) BRANCH( (int32_t)REG( d->rs1 ) >= (int32_t)REG( d->rs2 ) )
+		OP( BLTU ) BRANCH( REG( d->rs1 ) < REG( d->rs2 ) )
+		OP( BGEU ) BRANCH( REG( d->rs1 ) >= REG( d->rs2 ) )
+
+		LOAD( LB, load1s )
+		LOAD( LH, load2s )
+		OP( LW ) fuse_LW: LOAD_BODY( load4 )
+		LOAD( LBU, load1 )
+		LOAD( LHU, load2 )
+
+		STORE( SB, store1, 1 )
+		STORE( SH, store2, 2 )
+		STORE( SW, store4, 4 )
+
+		OP( CSR )
+		{
+			uint32_t csrno = d->imm;
+			uint32_t microop = d->rs2;
+			int rs1imm = d->rs1;
+			uint32_t rs1 = REG(rs1imm);
+			uint32_t writeval = rs1;
+
+			switch( csrno )
+			{
+			case 0x340: rval = CSR( mscratch ); break;
+			case 0x305: rval = CSR( mtvec ); break;
+			case 0x304: rval = CSR( mie ); break;
+			case 0xC00: rval = cycle; break;
+			case 0x344: rval = CSR( mip ); break;
+			case 0x341: rval = CSR( mepc ); break;
+			case 0x300: rval = CSR( mstatus ); break; //mstatus
+			case 0x342: rval = CSR( mcause ); break;
+			case 0x343: rval = CSR( mtval ); break;
+			case 0xf11: rval = 0xff0ff0ff; break; //mvendorid
+			case 0x301: rval = 0x40401101; break; //misa (XLEN=32, IMA+X)
+			default:
+				MINIRV32_OTHERCSR_READ( csrno, rval );
+				break;
+			}
+
+			switch( microop )
+			{
+				case 1: writeval = rs1; break;  			//CSRRW
+				case 2: writeval = rval | rs1; break;		//CSRRS
+				case 3: writeval = rval & ~rs1; break;		//CSRRC
+				case 5: writeval = rs1imm; break;			//CSRRWI
+				case 6: writeval = rval | rs1imm; break;	//CSRRSI
+				case 7: writeval = rval & ~rs1imm; break;	//CSRRCI
+			}
+
+			switch( csrno )
+			{
+			case 0x340: SETCSR( mscratch, writeval ); break;
+			case 0x305: SETCSR( mtvec, writeval ); break;
+			case 0x304: SETCSR( mie, writeval ); break;
+			case 0x344: SETCSR( mip, writeval ); break;
+			case 0x341: SETCSR( mepc, writeval ); break;
+			case 0x300: SETCSR( mstatus, writeval ); break; //mstatus
+			case 0x342: SETCSR( mcause, writeval ); break;
+			case 0x343: SETCSR( mtval, writeval ); break;
+			default:
+				MINIRV32_OTHERCSR_WRITE( csrno, writeval );
+				break;
+			}
+			if( d->rd ) REGSET( d->rd, rval );
+		} NEXT
+
+		OP( MRET )
+		{
+			uint32_t startmstatus = CSR( mstatus );
+			uint32_t startextraflags = CSR( extraflags );
+			SETCSR( mstatus , (( startmstatus & 0x80) >> 4) | ((startextraflags&3) << 11) | 0x80 );
+			SETCSR( extraflags, (startextraflags & ~3) | ((startmstatus >> 11) & 3) );
+			JUMP( CSR( mepc ) )
+		}
+		OP( ECALL ) TRAP( ( CSR( extraflags ) & 3) ? (11+1) : (8+1) ) // ECALL; 8 = "Environment call from U-mode"; 11 = "Environment call from M-mode"
+		OP( EBREAK ) TRAP( 3+1 ) // EBREAK 3 = "Breakpoint"
+		OP( WFI )
+		{
+			CSR( mstatus ) |= 8;    //Enable interrupts
+			CSR( extraflags ) |= 4; //Infor environment we want to go to sleep.
+			SETCSR( pc, pc + 4 );
+			return 1;
+		}
+
+		OP( AMO )
+		{
+			uint32_t rs1 = REG( d->rs1 );
+			uint32_t rs2 = REG( d->rs2 );
+			uint32_t irmid = d->imm;
+
+			rs1 -= MINIRV32_RAM_IMAGE_OFFSET;
+
+			if( rs1 >= MINI_RV32_RAM_SIZE-3 )
+			{
+				rval = rs1 + MINIRV32_RAM_IMAGE_OFFSET;
+				TRAP( 7+1 ) //Store/AMO access fault
+			}
+
+			rval = Bus::load4( image, rs1 );
+			uint32_t dowrite = 1;
+			switch( irmid )
+			{
+				case 2: //LR.W (0b00010)
+					dowrite = 0;
+					CSR( extraflags ) = (CSR( extraflags ) & 0x07) | (rs1<<3);
+					break;
+				case 3:  //SC.W (0b00011) (Make sure we have a slot, and, it's valid)
+					rval = ( CSR( extraflags ) >> 3 != ( rs1 & 0x1fffffff ) );  // Validate that our reservation slot is OK.
+					dowrite = !rval; // Only write if slot is valid.
+					break;
+				case 1: break; //AMOSWAP.W (0b00001)
+				case 0: rs2 += rval; break; //AMOADD.W (0b00000)
+				case 4: rs2 ^= rval; break; //AMOXOR.W (0b00100)
+				case 12: rs2 &= rval; break; //AMOAND.W (0b01100)
+				case 8: rs2 |= rval; break; //AMOOR.W (0b01000)
+				case 16: rs2 = ((int32_t)rs2<(int32_t)rval)?rs2:rval; break; //AMOMIN.W (0b10000)
+				case 20: rs2 = ((int32_t)rs2>(int32_t)rval)?rs2:rval; break; //AMOMAX.W (0b10100)
+				case 24: rs2 = (rs2<rval)?rs2:rval; break; //AMOMINU.W (0b11000)
+				case 28: rs2 = (rs2>rval)?rs2:rval; break; //AMOMAXU.W (0b11100)
+				default: TRAP( 2+1 ) //Not supported.
+			}
+			if( dowrite )
+			{
+				Bus::store4( image, rs1, rs2 );
+				if( DecodedNotifyStore( rs1, 4 ) ) e = e_end = 0;
+			}
+			if( d->rd ) REGSET( d->rd, rval );
+		} NEXT
+
+		OP( LUI_ADDI )
+		{
+			REGSET( d->rd, d->imm );
+			if( icount < count ) { uint32_t v = d->imm + d[1].imm; FUSE_SECOND; REGSET( d->rd, v ); }
+		} NEXT
+		OP( AUIPC_JALR )
+		{
+			REGSET( d->rd, pc + d->imm );
+			if( icount < count ) { FUSE_SECOND; goto fuse_JALR; }
+		} NEXT
+		OP( AUIPC_LW )
+		{
+			REGSET( d->rd, pc + d->imm );
+			if( icount < count ) { FUSE_SECOND; goto fuse_LW; }
+		} NEXT
+		OP( SLLI_SRLI )
+		{
+			uint32_t v = REG( d->rs1 ) << d->imm;
+			REGSET( d->rd, v );
+			if( icount < count ) { FUSE_SECOND; REGSET( d->rd, v >> d->imm ); }
+		} NEXT
+		CMP_BRANCH( SLT_BR, (int32_t)REG( d->rs1 ) < (int32_t)REG( d->rs2 ) )
+		CMP_BRANCH( SLTU_BR, REG( d->rs1 ) < REG( d->rs2 ) )
+		CMP_BRANCH( SLTI_BR, (int32_t)REG( d->rs1 ) < d->imm )
+		CMP_BRANCH( SLTIU_BR, REG( d->rs1 ) < (uint32_t)d->imm )
+
+		OP( FETCHFAULT )
+		{
+			trap = 1 + 1;  // Handle access violation on instruction read.
+			goto out;
+		}
+		OP( ILLEGAL ) TRAP( 2+1 ) // Fault: Invalid opcode.
+
+#if !DECODED_STEP_THREADED
+		}
+#endif
+
+	refetch:
+		{
+			uint32_t ofs_pc = pc - MINIRV32_RAM_IMAGE_OFFSET;
+			if( ofs_pc >= MINI_RV32_RAM_SIZE )
+			{
+				trap = 1 + 1;  // Handle access violation on instruction read.
+				goto out;
+			}
+			else if( ofs_pc & 3 )
+			{
+				trap = 1 + 0;  //Handle PC-misaligned access
+				goto out;
+			}
+			e = DecodedLookup( image, ofs_pc, &e_end );
+		}
+		goto decoded;
+
+	trapped:
+		// If there was a trap, do NOT allow register writeback.
+		{
+			uint32_t ir = Bus::load4( image, pc - MINIRV32_RAM_IMAGE_OFFSET );
+			SETCSR( pc, pc );
+			STEP_POSTEXEC( ir, trap );
+		}
+	}
+out:
+
+	// Handle traps and interrupts.
+	if( trap )
+	{
+		if( trap & 0x80000000 ) // If prefixed with 1 in MSB, it's an interrupt, not a trap.
+		{
+			SETCSR( mcause, trap );
+			SETCSR( mtval, 0 );
+			pc += 4; // PC needs to point to where the PC will return to.
+		}
+		else
+		{
+			SETCSR( mcause,  trap - 1 );
+			SETCSR( mtval, (trap > 5 && trap <= 8)? rval : pc );
+		}
+		SETCSR( mepc, pc ); //TRICKY: The kernel advances mepc automatically.
+		//CSR( mstatus ) & 8 = MIE, & 0x80 = MPIE
+		// On an interrupt, the system moves current MIE into MPIE
+		SETCSR( mstatus, (( CSR( mstatus ) & 0x08) << 4) | (( CSR( extraflags ) & 3 ) << 11) );
+		pc = CSR( mtvec );
+
+		// If trapping, always enter machine mode.
+		CSR( extraflags ) |= 3;
+
+		trap = 0;
+	}
+
+	if( CSR( cyclel ) > cycle ) CSR( cycleh )++;
+	SETCSR( cyclel, cycle );
+	SETCSR( pc, pc );
+	return 0;
+}
+
+#undef OP
+#undef NEXT
+#undef JUMP
+#undef TRAP
+#undef BRANCH
+#undef LOAD
+#undef LOAD_BODY
+#undef STORE
+#undef FUSE_SECOND
+#undef CMP_BRANCH
+#undef STEP_POSTEXEC
+#undef GUARD_MARK
+#undef TRACE
+#undef MINI_RV32_RAM_SIZE
+#define MINI_RV32_RAM_SIZE ram_amt
@@ -0,0 +1,277 @@
+//
+// Created by liujilan on 25-10-19.
+//
+
+#include "decoder.h"
+#include "jit.h"
+
+#include <vector>
+
+struct DecodedInsn ** decoded_pages = 0;	// # 按页索引, 0 表示未解码
+static uint32_t decoded_npages = 0;
+static std::vector<struct DecodedInsn *> decoded_free;	// # 失效的页缓冲, 复用而不是 free
+static std::vector<uint32_t> decoded_live;	// # 解码过的页号 (可能有已失效或重复的), 全部作废时只扫这些
+uint64_t decoded_fuse_hits[DOP_COUNT];
+
+static const char * const decoded_op_names[DOP_COUNT] = {
+#define DECODED_OP_NAME( name ) #name,
+	DECODED_OPS( DECODED_OP_NAME )
+#undef DECODED_OP_NAME
+};
+
+void DecodeInsn( struct DecodedInsn * d, uint32_t ir )
+{
+	uint32_t rd = ( ir >> 7 ) & 0x1f;
+	uint32_t funct3 = ( ir >> 12 ) & 0x7;
+	uint32_t rs1 = ( ir >> 15 ) & 0x1f;
+	uint32_t rs2 = ( ir >> 20 ) & 0x1f;
+	int32_t immI = (int32_t)ir >> 20;
+
+	d->op = DOP_ILLEGAL;
+	d->rd = rd;
+	d->rs1 = rs1;
+	d->rs2 = rs2;
+	d->imm = 0;
+
+	switch( ir & 0x7f )
+	{
+		case 0x37: // LUI
+			d->op = DOP_LUI;
+			d->imm = ir & 0xfffff000;
+			break;
+		case 0x17: // AUIPC
+			d->op = DOP_AUIPC;
+			d->imm = ir & 0xfffff000;
+			break;
+		case 0x6F: // JAL
+		{
+			int32_t reladdy = ((ir & 0x80000000)>>11) | ((ir & 0x7fe00000)>>20) | ((ir & 0x00100000)>>9) | ((ir&0x000ff000));
+			if( reladdy & 0x00100000 ) reladdy |= 0xffe00000; // Sign extension.
+			d->op = DOP_JAL;
+			d->imm = reladdy;
+			return;
+		}
+		case 0x67: // JALR
+			d->op = DOP_JALR;
+			d->imm = immI;
+			return;
+		case 0x63: // Branch
+		{
+			static const uint8_t ops[8] = { DOP_BEQ, DOP_BNE, DOP_ILLEGAL, DOP_ILLEGAL, DOP_BLT, DOP_BGE, DOP_BLTU, DOP_BGEU };
+			uint32_t immm4 = ((ir & 0xf00)>>7) | ((ir & 0x7e000000)>>20) | ((ir & 0x80) << 4) | ((ir >> 31)<<12);
+			if( immm4 & 0x1000 ) immm4 |= 0xffffe000;
+			d->op = ops[funct3];
+			d->rd = 0;
+			d->imm = immm4;
+			return;
+		}
+		case 0x03: // Load
+		{
+			static const uint8_t ops[8] = { DOP_LB, DOP_LH, DOP_LW, DOP_ILLEGAL, DOP_LBU, DOP_LHU, DOP_ILLEGAL, DOP_ILLEGAL };
+			d->op = ops[funct3];
+			d->imm = immI;
+			return;
+		}
+		case 0x23: // Store
+		{
+			static const uint8_t ops[8] = { DOP_SB, DOP_SH, DOP_SW, DOP_ILLEGAL, DOP_ILLEGAL, DOP_ILLEGAL, DOP_ILLEGAL, DOP_ILLEGAL };
+			uint32_t addy = ( ( ir >> 7 ) & 0x1f ) | ( ( ir & 0xfe000000 ) >> 20 );
+			if( addy & 0x800 ) addy |= 0xfffff000;
+			d->op = ops[funct3];
+			d->rd = 0;
+			d->imm = addy;
+			return;
+		}
+		case 0x13: // Op-immediate
+		{
+			static const uint8_t ops[8] = { DOP_ADDI, DOP_SLLI, DOP_SLTI, DOP_SLTIU, DOP_XORI, DOP_SRLI, DOP_ORI, DOP_ANDI };
+			d->op = ops[funct3];
+			d->imm = immI;
+			if( funct3 == 1 || funct3 == 5 )
+			{
+				d->imm = immI & 0x1f;
+				if( funct3 == 5 && ( ir & 0x40000000 ) ) d->op = DOP_SRAI;
+			}
+			break;
+		}
+		case 0x33: // Op
+		{
+			static const uint8_t ops[8] = { DOP_ADD, DOP_SLL, DOP_SLT, DOP_SLTU, DOP_XOR, DOP_SRL, DOP_OR, DOP_AND };
+			static const uint8_t mops[8] = { DOP_MUL, DOP_MULH, DOP_MULHSU, DOP_MULHU, DOP_DIV, DOP_DIVU, DOP_REM, DOP_REMU };
+			if( ir & 0x02000000 )
+				d->op = mops[funct3];
+			else
+			{
+				d->op = ops[funct3];
+				if( ( ir & 0x40000000 ) && funct3 == 0 ) d->op = DOP_SUB;
+				if( ( ir & 0x40000000 ) && funct3 == 5 ) d->op = DOP_SRA;
+			}
+			break;
+		}
+		case 0x0f: // FENCE
+			d->op = DOP_NOP;
+			return;
+		case 0x73: // Zicsr / SYSTEM
+		{
+			uint32_t csrno = ir >> 20;
+			if( funct3 & 3 )
+			{
+				d->op = DOP_CSR;
+				d->rs2 = funct3;
+				d->imm = csrno;
+			}
+			else if( funct3 == 0 )
+			{
+				d->rd = 0;
+				if( ( csrno & 0xff ) == 0x02 ) d->op = DOP_MRET;
+				else if( csrno == 0 ) d->op = DOP_ECALL;
+				else if( csrno == 1 ) d->op = DOP_EBREAK;
+				else if( csrno == 0x105 ) d->op = DOP_WFI;
+			}
+			return;
+		}
+		case 0x2f: // RV32A
+			d->op = DOP_AMO;
+			d->imm = ( ir >> 27 ) & 0x1f;
+			return;
+		default:
+			return;
+	}
+
+	// 纯运算写 x0 没有任何效果
+	if( rd == 0 && d->op != DOP_ILLEGAL ) d->op = DOP_NOP;
+}
+
+void DecodeFusePairs( struct DecodedInsn * p, uint32_t n )
+{
+	for( uint32_t i = 0; i + 1 < n; i++ )
+	{
+		struct DecodedInsn * a = p + i;
+		const struct DecodedInsn * b = p + i + 1;
+
+		// # 第二条必须读第一条的结果; 第一条的 rd 一定非 0 (写 x0 的已经变成 NOP)
+		if( b->rs1 != a->rd ) continue;
+
+		switch( a->op )
+		{
+			case DOP_LUI:	// lui + addi: 装载 32 位常数
+				if( b->op == DOP_ADDI ) a->op = DOP_LUI_ADDI;
+				break;
+			case DOP_AUIPC:	// auipc + jalr: 远调用; auipc + lw: PC 相对装载
+				if( b->op == DOP_JALR ) a->op = DOP_AUIPC_JALR;
+				else if( b->op == DOP_LW ) a->op = DOP_AUIPC_LW;
+				break;
+			case DOP_SLLI:	// slli + srli: 零扩展 / 取位段
+				if( b->op == DOP_SRLI ) a->op = DOP_SLLI_SRLI;
+				break;
+			case DOP_SLT: case DOP_SLTU: case DOP_SLTI: case DOP_SLTIU:	// 比较 + beqz / bnez
+			{
+				static const uint8_t fused[4] = { DOP_SLT_BR, DOP_SLTU_BR, DOP_SLTI_BR, DOP_SLTIU_BR };
+				static const uint8_t base[4] = { DOP_SLT, DOP_SLTU, DOP_SLTI, DOP_SLTIU };
+				if( ( b->op == DOP_BEQ || b->op == DOP_BNE ) && b->rs2 == 0 )
+					for( int k = 0; k < 4; k++ )
+						if( a->op == base[k] ) { a->op = fused[k]; break; }
+				break;
+			}
+		}
+	}
+}
+
+static void DecodedReset()
+{
+	// # 重启时会调用, 开销只和解码过的页数有关, 不随 RAM 大小增长
+	for( uint32_t i : decoded_live )
+	{
+		if( decoded_pages[i] ) decoded_free.push_back( decoded_pages[i] );
+		decoded_pages[i] = 0;
+	}
+	decoded_live.clear();
+}
+
+const struct DecodedInsn * DecodedLookup( uint8_t * image, uint32_t ofs, const struct DecodedInsn ** page_end )
+{
+	uint32_t page = ofs >> DECODE_PAGE_SHIFT;
+	if( !decoded_pages )
+	{
+		decoded_npages = ( MINI_RV32_RAM_SIZE + DECODE_PAGE_SIZE - 1 ) >> DECODE_PAGE_SHIFT;
+		decoded_pages = (struct DecodedInsn **)calloc( decoded_npages, sizeof( struct DecodedInsn * ) );
+	}
+
+	struct DecodedInsn * p = decoded_pages[page];
+	if( !p )
+	{
+		if( decoded_free.empty() )
+			p = (struct DecodedInsn *)malloc( DECODE_PAGE_INSNS * sizeof( struct DecodedInsn ) );
+		else
+		{
+			p = decoded_free.back();
+			decoded_free.pop_back();
+		}
+
+		uint32_t base = page << DECODE_PAGE_SHIFT;
+		for( uint32_t i = 0; i < DECODE_PAGE_INSNS; i++ )
+		{
+			uint32_t iofs = base + i * 4;
+			if( iofs < MINI_RV32_RAM_SIZE - 3 )
+				DecodeInsn( p + i, MINIRV32_LOAD4( iofs ) );
+			else
+			{
+				p[i].op = DOP_FETCHFAULT;
+				p[i].rd = 0;
+			}
+		}
+		DecodeFusePairs( p, DECODE_PAGE_INSNS );
+		// # 自修改代码反复失效再解码时列表会变长, 超过总页数就整体作废一次
+		if( decoded_live.size() >= decoded_npages ) DecodedReset();
+		decoded_live.push_back( page );
+		decoded_pages[page] = p;
+	}
+
+	*page_end = p + DECODE_PAGE_INSNS;
+	return p + ( ( ofs & ( DECODE_PAGE_SIZE - 1 ) ) >> 2 );
+}
+
+int DecodedInvalidatePage( uint32_t page )
+{
+	decoded_free.push_back( decoded_pages[page] );
+	decoded_pages[page] = 0;
+	return 1;
+}
+
+// # JIT 块缓存 (core/jit.h) 和这里的页大小相同, 一起失效
+static_assert( JIT_PAGE_SHIFT == DECODE_PAGE_SHIFT, "JIT and decoded caches share page numbers" );
+
+void MiniRV32IMAInvalidateDecoded( uint32_t ofs, uint32_t len )
+{
+	if( !len ) return;
+	uint32_t last = ( ofs + len - 1 ) >> DECODE_PAGE_SHIFT;
+	for( uint32_t page = ofs >> DECODE_PAGE_SHIFT; page <= last && ( page < decoded_npages || page < jit_npages ); page++ )
+	{
+		if( page < decoded_npages && decoded_pages[page] ) DecodedInvalidatePage( page );
+		if( page < jit_npages && jit_code_pages[page] ) JitInvalidatePage( page );
+	}
+}
+
+void MiniRV32IMAFlushDecoded()
+{
+	if( decoded_pages ) DecodedReset();
+	JitFlush();
+}
+
+void DecodedTrace( uint8_t * image, uint32_t pc, const struct DecodedInsn * d )
+{
+	fprintf( stderr, "%08x [%08x] %s\n", pc, MINIRV32_LOAD4( pc - MINIRV32_RAM_IMAGE_OFFSET ), decoded_op_names[d->op] );
+}
+
+void MiniRV32IMAReportFusion( uint64_t retired )
+{
+	uint64_t total = 0;
+	for( int op = DOP_LUI_ADDI; op < DOP_COUNT; op++ )
+	{
+		total += decoded_fuse_hits[op];
+		fprintf( stderr, "fusion %-12s %12llu\n", decoded_op_names[op], (unsigned long long)decoded_fuse_hits[op] );
+	}
+	// 每次融合覆盖两条指令
+	fprintf( stderr, "fusion total        %12llu (%.2f%% of %llu retired instructions)\n",
+		(unsigned long long)total, retired ? 200.0 * total / retired : 0.0, (unsigned long long)retired );
+}
@@ -0,0 +1,90 @@
+//
+// Created by liujilan on 25-10-19.
+//
+
+#ifndef DECODER_H
+#define DECODER_H
+
+#include "core.h"
+
+// # 预解码指令缓存
+// # 以 4KiB 的 guest 页为单位, 第一次执行到某页时整页解码, 之后 step 循环只读解码后的条目:
+// #   - handler 编号(完全特化到具体操作, 比如 ADDI / LW / BEQ)
+// #   - rd / rs1 / rs2 编号
+// #   - 已经符号扩展好的立即数
+// # PC 的范围 / 对齐检查只在进入一页时做一次, 页内顺序执行只移动指针.
+// # 对已解码页的写入会让该页失效, 下次执行到时重新解码.
+
+#define DECODE_PAGE_SHIFT	12
+#define DECODE_PAGE_SIZE	(1u << DECODE_PAGE_SHIFT)
+#define DECODE_PAGE_INSNS	(DECODE_PAGE_SIZE / 4)
+
+// # 全部 handler, 顺序即 DecodedOp 的取值; threaded 引擎用它生成分发表
+#define DECODED_OPS( X ) \
+	X( ILLEGAL )	/* 非法指令, 陷入 (2+1) */ \
+	X( FETCHFAULT )	/* 页内超出 RAM 的部分, 取指访问异常 (1+1) */ \
+	X( NOP )		/* 写 x0 的纯运算 / FENCE */ \
+	X( LUI ) X( AUIPC ) X( JAL ) X( JALR ) \
+	X( BEQ ) X( BNE ) X( BLT ) X( BGE ) X( BLTU ) X( BGEU ) \
+	X( LB ) X( LH ) X( LW ) X( LBU ) X( LHU ) \
+	X( SB ) X( SH ) X( SW ) \
+	X( ADDI ) X( SLTI ) X( SLTIU ) X( XORI ) X( ORI ) X( ANDI ) X( SLLI ) X( SRLI ) X( SRAI ) \
+	X( ADD ) X( SUB ) X( SLL ) X( SLT ) X( SLTU ) X( XOR ) X( SRL ) X( SRA ) X( OR ) X( AND ) \
+	X( MUL ) X( MULH ) X( MULHSU ) X( MULHU ) X( DIV ) X( DIVU ) X( REM ) X( REMU ) \
+	X( CSR )		/* Zicsr: imm = csrno, rs2 = funct3, rs1 = rs1 编号(也是 zimm) */ \
+	X( ECALL ) X( EBREAK ) X( MRET ) X( WFI ) \
+	X( AMO )		/* RV32A: imm = funct5 */ \
+	/* 融合的指令对: 条目里仍是第一条的字段, 第二条就是下一个条目 (两条总在同一页) */ \
+	X( LUI_ADDI ) X( AUIPC_JALR ) X( AUIPC_LW ) X( SLLI_SRLI ) \
+	X( SLT_BR ) X( SLTU_BR ) X( SLTI_BR ) X( SLTIU_BR )
+
+enum DecodedOp
+{
+#define DECODED_OP_ENUM( name ) DOP_##name,
+	DECODED_OPS( DECODED_OP_ENUM )
+#undef DECODED_OP_ENUM
+	DOP_COUNT
+};
+
+// 8 字节一条, 一页 1024 条 = 8KiB
+struct DecodedInsn
+{
+	uint8_t op;
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+	int32_t imm;
+};
+
+// 解码单条指令
+void DecodeInsn( struct DecodedInsn * d, uint32_t ir );
+
+// # 一页解码完后找出可以融合的指令对, 把第一条改成融合 op; 第二条的条目保持原样,
+// # 这样跳到第二条, 或者剩余预算只够一条时, 仍然可以单独执行.
+void DecodeFusePairs( struct DecodedInsn * p, uint32_t n );
+
+// # 每种融合 op 实际执行的次数 (按 op 编号索引)
+extern uint64_t decoded_fuse_hits[DOP_COUNT];
+
+// # 打印一条执行轨迹到 stderr (只有 Config::kTrace 的实例会调用)
+void DecodedTrace( uint8_t * image, uint32_t pc, const struct DecodedInsn * d );
+
+// 取 ofs (RAM 内偏移, 已经检查过范围和对齐) 对应的解码条目, 必要时整页解码.
+// *page_end 返回该页条目的尾后指针.
+const struct DecodedInsn * DecodedLookup( uint8_t * image, uint32_t ofs, const struct DecodedInsn ** page_end );
+
+// 写入 RAM 后调用; 只有命中已解码页时才返回非 0 (此时该页已失效, 调用方需要重新查找当前页)
+extern struct DecodedInsn ** decoded_pages;
+int DecodedInvalidatePage( uint32_t page );
+
+static inline int DecodedNotifyStore( uint32_t ofs, uint32_t len )
+{
+	uint32_t first = ofs >> DECODE_PAGE_SHIFT;
+	uint32_t last = ( ofs + len - 1 ) >> DECODE_PAGE_SHIFT;
+	int hit = 0;
+	if( decoded_pages && decoded_pages[first] ) hit |= DecodedInvalidatePage( first );
+	if( last != first && decoded_pages && decoded_pages[last] ) hit |= DecodedInvalidatePage( last );
+	return hit;
+}
+
+#endif //DECODER_H
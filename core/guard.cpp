@@ -0,0 +1,123 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#include "guard.h"
+#include "decoder.h"
+#include "hostmem.h"
+
+#include <signal.h>
+#include <sys/mman.h>
+
+struct GuardContext guard_ctx;
+sigjmp_buf guard_env;
+
+static uint8_t * guard_base;	// # 4GiB 保留区的起点, 对应 guest 地址 0
+static uint32_t guard_ram_size;
+static const uint64_t guard_span = ( 1ull << 32 ) + 4096;	// # 多一页, 4GiB 末尾的非对齐访问也落在保留区里
+
+int GuardSlowAccess( struct MiniRV32IMAState * state, uint8_t * image, uint32_t pc, uint32_t * rval )
+{
+	struct DecodedInsn d;
+	DecodeInsn( &d, MINIRV32_LOAD4( pc - MINIRV32_RAM_IMAGE_OFFSET ) );
+
+	uint32_t addy = REG( d.rs1 ) + d.imm;
+	uint32_t ofs = addy - MINIRV32_RAM_IMAGE_OFFSET;
+	uint32_t val = 0;
+
+	switch( d.op )
+	{
+		case DOP_LB: case DOP_LH: case DOP_LW: case DOP_LBU: case DOP_LHU:
+			if( ofs < MINI_RV32_RAM_SIZE - 3 )
+			{
+				switch( d.op )
+				{
+					case DOP_LB: val = MINIRV32_LOAD1_SIGNED( ofs ); break;
+					case DOP_LH: val = MINIRV32_LOAD2_SIGNED( ofs ); break;
+					case DOP_LW: val = MINIRV32_LOAD4( ofs ); break;
+					case DOP_LBU: val = MINIRV32_LOAD1( ofs ); break;
+					case DOP_LHU: val = MINIRV32_LOAD2( ofs ); break;
+				}
+			}
+			else if( MINIRV32_MMIO_RANGE( addy ) )
+				val = HandleControlLoad( addy );
+			else
+			{
+				*rval = addy;
+				return 5 + 1;
+			}
+			if( d.rd ) REGSET( d.rd, val );
+			return 0;
+
+		case DOP_SB: case DOP_SH: case DOP_SW:
+			val = REG( d.rs2 );
+			if( ofs < MINI_RV32_RAM_SIZE - 3 )
+			{
+				switch( d.op )
+				{
+					case DOP_SB: MINIRV32_STORE1( ofs, val ); break;
+					case DOP_SH: MINIRV32_STORE2( ofs, val ); break;
+					case DOP_SW: MINIRV32_STORE4( ofs, val ); break;
+				}
+				DecodedNotifyStore( ofs, d.op == DOP_SB ? 1 : d.op == DOP_SH ? 2 : 4 );
+			}
+			else if( MINIRV32_MMIO_RANGE( addy ) )
+			{
+				if( HandleControlStore( addy, val ) )
+				{
+					*rval = val;
+					return -1;
+				}
+			}
+			else
+			{
+				*rval = addy;
+				return 7 + 1;
+			}
+			return 0;
+	}
+
+	// # 只有 load / store 走不检查的路径, 到这里说明是模拟器自身的访存出了错
+	fprintf( stderr, "guard: unexpected fault at pc %08x\n", pc );
+	abort();
+}
+
+static void GuardSignal( int sig, siginfo_t * si, void * uctx )
+{
+	uint8_t * a = (uint8_t *)si->si_addr;
+	uint8_t * ram = guard_base + MINIRV32_RAM_IMAGE_OFFSET;
+	if( guard_ctx.active && sig == SIGSEGV && guard_base && a >= guard_base && a < guard_base + guard_span &&
+		!( a >= ram && a < ram + guard_ram_size ) )
+		siglongjmp( guard_env, 1 );
+
+	// # 不是 guest 访存引起的: 恢复默认处理, 返回后重新触发, 照常崩溃
+	signal( sig, SIG_DFL );
+}
+
+uint8_t * MiniRV32IMAGuardAlloc( uint32_t ram_size, int hugetlb )
+{
+	// # 多保留一个大页, 把 base 对齐到 2MiB, RAM 起点 (base + 0x80000000) 也就对齐了, 才能用上大页
+	uint8_t * raw = (uint8_t *)mmap( 0, guard_span + HOSTMEM_HUGE_PAGE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if( raw == MAP_FAILED ) return 0;
+	uint8_t * base = (uint8_t *)( ( (uintptr_t)raw + HOSTMEM_HUGE_PAGE - 1 ) & ~(uintptr_t)( HOSTMEM_HUGE_PAGE - 1 ) );
+
+	uint8_t * ram = base + MINIRV32_RAM_IMAGE_OFFSET;
+	if( HostRamMapAt( ram, ram_size, hugetlb ) )
+	{
+		munmap( raw, guard_span + HOSTMEM_HUGE_PAGE );
+		return 0;
+	}
+
+	// # SA_NODEFER: siglongjmp 出去时不恢复信号屏蔽字, 不能让 SIGSEGV 一直被屏蔽着
+	struct sigaction sa;
+	memset( &sa, 0, sizeof( sa ) );
+	sa.sa_sigaction = GuardSignal;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset( &sa.sa_mask );
+	sigaction( SIGSEGV, &sa, 0 );
+	sigaction( SIGBUS, &sa, 0 );
+
+	guard_base = base;
+	guard_ram_size = ram_size;
+	return ram;
+}
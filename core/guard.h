@@ -0,0 +1,48 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef GUARD_H
+#define GUARD_H
+
+#include "core.h"
+
+#include <setjmp.h>
+
+// # guard 模式 (-g): 主机上保留 4GiB (+1 页) 的 PROT_NONE 区域, 与 guest 物理地址空间一一对应,
+// # RAM 映射在 base + MINIRV32_RAM_IMAGE_OFFSET, 其余都不可访问.
+// # GuardBus 的 load / store 直接访问 base + guest 地址, 不做范围检查;
+// # 落到 RAM 之外时触发 SIGSEGV, 处理函数 siglongjmp 回 GuardEnter, 它再调用 step 接着这一片执行,
+// # step 用带检查的慢路径 (MMIO 调出或访问异常) 重做出错的那一条.
+// # step 之外的出错, SIGBUS, 以及落在 RAM 里的出错 (比如映射的镜像文件被截短) 都不是 guest 越界, 照常崩溃.
+
+// # step 在每次不检查的访存前记下当前指令, 出错后据此恢复 (cycle 与 icount 在一次 step 内同步增长)
+struct GuardContext
+{
+	uint32_t pc;
+	int icount;
+	int resume;		// # GuardEnter 重新调用 step 时置 1, step 跳过开头的时间和中断处理, 从出错那条接着执行
+	volatile int active;	// # 只在 GuardEnter 调用 step 期间为 1, 此时 guard_env 才指向活着的栈帧
+};
+
+extern struct GuardContext guard_ctx;
+extern sigjmp_buf guard_env;
+
+// # 慢路径重做 pc 处的 load / store. 返回 0 = 已完成 (含 rd 写回);
+// # 返回 trap 码时 *rval 为 mtval; 返回 -1 时 *rval 是 syscon 的返回码, step 要直接带着它返回.
+int GuardSlowAccess( struct MiniRV32IMAState * state, uint8_t * image, uint32_t pc, uint32_t * rval );
+
+// # guard 实例的入口. sigsetjmp 放在这一层而不是 step 里: 跨过 sigsetjmp 还活着的局部变量
+// # 编译器只能放在栈上, 放在 step 里会让热循环的 pc / 解码指针 / 计数全部落到内存.
+template< MiniRV32IMAStepFn step >
+int32_t GuardEnter( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count )
+{
+	if( sigsetjmp( guard_env, 0 ) )
+		guard_ctx.resume = 1;
+	guard_ctx.active = 1;
+	int32_t ret = step( state, image, vProcAddress, elapsedUs, count );
+	guard_ctx.active = 0;
+	return ret;
+}
+
+#endif //GUARD_H
@@ -0,0 +1,39 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef JIT_H
+#define JIT_H
+
+#include "core.h"
+
+// # JIT 块缓存 (core/single_core.cpp)
+// # 块不跨 4KiB 的 guest 页, 按所在页分组; 和预解码缓存一样, 对有块的页的写入让整页的块失效:
+// #   - 解释器自己的写入走 JitNotifyStore
+// #   - DMA / 镜像重新装载走 MiniRV32IMAInvalidateDecoded / MiniRV32IMAFlushDecoded, 和预解码缓存共用同一个入口
+// #   - 生成代码里的 store 快路径直接查 jit_code_pages, 目标页有块时交回解释器去写, 块就此结束
+
+#define JIT_PAGE_SHIFT	12
+
+extern uint8_t * jit_code_pages;	// # 按页索引, 非 0 表示该页有生成了代码的块
+extern uint32_t jit_npages;
+
+void JitInvalidatePage( uint32_t page );
+void JitFlush();
+
+// # ofs 已经检查过在 RAM 之内
+static inline int JitCodeHit( uint32_t ofs, uint32_t len )
+{
+	return jit_code_pages && ( jit_code_pages[ofs >> JIT_PAGE_SHIFT] | jit_code_pages[( ofs + len - 1 ) >> JIT_PAGE_SHIFT] );
+}
+
+static inline void JitNotifyStore( uint32_t ofs, uint32_t len )
+{
+	if( !JitCodeHit( ofs, len ) ) return;
+	uint32_t first = ofs >> JIT_PAGE_SHIFT;
+	uint32_t last = ( ofs + len - 1 ) >> JIT_PAGE_SHIFT;
+	if( jit_code_pages[first] ) JitInvalidatePage( first );
+	if( last != first && jit_code_pages[last] ) JitInvalidatePage( last );
+}
+
+#endif //JIT_H
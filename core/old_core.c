@@ -19,6 +19,10 @@ int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint3
 	else
 		CSR( mip ) &= ~(1<<7);
 
+	// # MEIP 由 shell 按 PLIC 的状态维护, 挂着时同样唤醒 WFI
+	if( CSR( mip ) & (1<<11) )
+		CSR( extraflags ) &= ~4;
+
 	// If WFI, don't run processor.
 	if( CSR( extraflags ) & 4 )
 		return 1;
@@ -28,10 +32,11 @@ int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint3
 	uint32_t pc = CSR( pc );		// # 这里的pc是下一条即将要执行的指令的地址
 	uint32_t cycle = CSR( cyclel );
 
-	if( ( CSR( mip ) & (1<<7) ) && ( CSR( mie ) & (1<<7) /*mtie*/ ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
+	uint32_t irq = CSR( mip ) & CSR( mie ) & ( (1<<11) | (1<<7) );	// # MEIE / MTIE
+	if( irq && ( CSR( mstatus ) & 0x8 /*mie*/) )
 	{
-		// Timer interrupt.
-		trap = 0x80000007;
+		// # 外部中断 (PLIC) 优先于定时器中断
+		trap = ( irq & (1<<11) ) ? 0x8000000b : 0x80000007;
 		pc -= 4;	// # 后文中, 中断会和正常指令一样, 经历"完成当前指令后" +4的行为
 					// # 但是由于中断本质上没有实际上执行, 所以要提前-4
 					// # 对于异常而言, 由于提前break离开了, 不会经历+4的过程, 所以也是当前指令进入mepc
@@ -119,6 +124,7 @@ int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint3
 						if( MINIRV32_MMIO_RANGE( rsval ) )  // UART, CLNT
 						{
 							MINIRV32_HANDLE_MEM_LOAD_CONTROL( rsval, rval );
+							MINIRV32_MMIO_YIELD( count );
 						}
 						else
 						{
@@ -156,6 +162,7 @@ int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint3
 						if( MINIRV32_MMIO_RANGE( addy ) )
 						{
 							MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, rs2 );
+							MINIRV32_MMIO_YIELD( count );
 						}
 						else
 						{
@@ -3,19 +3,414 @@
 //
 
 #include "core.h"
+#include "jit.h"
 
 #include "qbe_jit_api.h"
 #include "rv32i_qbe_trans_v01.h"
 
 #include <unordered_map>
+#include <vector>
 #include <cstdlib>   // std::getenv
 #include <cstdio>    // fprintf
 
 struct JitEntry {
 	qbejit::Handle h;   // 持有 dlopen 句柄
-	qbejit::JitFn fn;   // 函数指针
+	qbejit::JitFn fn;   // 函数指针, nullptr 表示该 pc 不翻译
+	int len;            // 块内指令条数(最长执行路径)
 };
 
+// # syscon 的返回码要带出 SingleExec, 由 step 带着它返回
+#undef MINIRV32_HANDLE_MEM_STORE_CONTROL
+#define MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, val ) if( HandleControlStore( addy, val ) ) { rval = val; return EXEC_SYSCON; }
+
+// # JIT 块按所在页分组 (见 core/jit.h), 块内 pc -> 块
+static std::vector< std::unordered_map<uint32_t, JitEntry> > jit_pages;
+uint8_t * jit_code_pages;
+uint32_t jit_npages;
+static uint32_t jit_builds;		// # 生成的 .so 按序号命名, 失效后重新翻译同一个 pc 不会撞上还没卸载干净的旧文件
+static int jit_broken;			// # qbe / cc 调用失败过
+
+void JitInvalidatePage( uint32_t page )
+{
+	for( auto & b : jit_pages[page] )
+		qbejit::unload( b.second.h );
+	jit_pages[page].clear();
+	jit_code_pages[page] = 0;
+}
+
+void JitFlush()
+{
+	for( uint32_t page = 0; page < jit_npages; page++ )
+		if( jit_code_pages[page] ) JitInvalidatePage( page );
+}
+
+// # SingleExec 的结果
+enum
+{
+	EXEC_NEXT,		// # 正常执行完 (含 rd 写回)
+	EXEC_TRAP,		// # 陷入, trap (以及地址类异常的 rval) 已设置, rd 没有写
+	EXEC_WFI,		// # WFI, pc 已经存回 state
+	EXEC_SYSCON,	// # syscon 要求退出, rval 是返回码
+	EXEC_HANDBACK,	// # 只在 kInBlock 时出现: 这条指令还没有产生任何副作用, 交回 step 循环执行
+};
+
+// # 解释器的单条指令 (取指之后到写回 rd 为止), step 循环和 JIT 块里的 helper 共用同一份语义.
+// # pc 是这条指令的地址, 跳转时改成 "目标 - 4"; cycle 只用于读 cycle CSR.
+// # kInBlock = 1 给 helper 用: MMIO 读写 (回调和 mmio_yield 只能由 step 处理) 和写到有 JIT 块的页都交回去.
+template< bool kInBlock >
+static inline int SingleExec( struct MiniRV32IMAState * state, uint8_t * image, uint32_t & pc, uint32_t ir, uint32_t cycle, uint32_t & trap, uint32_t & rval, int & count )
+{
+	uint32_t rdid = (ir >> 7) & 0x1f;	// # 解析出 rd 寄存器编号 (写回目标)
+	switch( ir & 0x7f )
+	{
+		case 0x37: // LUI (0b0110111)
+			rval = ( ir & 0xfffff000 );
+			break;
+		case 0x17: // AUIPC (0b0010111)
+			rval = pc + ( ir & 0xfffff000 );
+			break;
+		case 0x6F: // JAL (0b1101111)
+		{
+			int32_t reladdy = ((ir & 0x80000000)>>11) | ((ir & 0x7fe00000)>>20) | ((ir & 0x00100000)>>9) | ((ir&0x000ff000));
+			if( reladdy & 0x00100000 ) reladdy |= 0xffe00000; // Sign extension.
+			rval = pc + 4;
+			pc = pc + reladdy - 4;
+			break;
+		}
+		case 0x67: // JALR (0b1100111)
+		{
+			uint32_t imm = ir >> 20;
+			int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
+			rval = pc + 4;
+			pc = ( (REG( (ir >> 15) & 0x1f ) + imm_se) & ~1) - 4;
+			break;
+		}
+		case 0x63: // Branch (0b1100011)
+		{
+			uint32_t immm4 = ((ir & 0xf00)>>7) | ((ir & 0x7e000000)>>20) | ((ir & 0x80) << 4) | ((ir >> 31)<<12);
+			if( immm4 & 0x1000 ) immm4 |= 0xffffe000;
+			int32_t rs1 = REG((ir >> 15) & 0x1f);
+			int32_t rs2 = REG((ir >> 20) & 0x1f);
+			immm4 = pc + immm4 - 4;
+			rdid = 0;
+			switch( ( ir >> 12 ) & 0x7 )
+			{
+				// BEQ, BNE, BLT, BGE, BLTU, BGEU
+				case 0: if( rs1 == rs2 ) pc = immm4; break;
+				case 1: if( rs1 != rs2 ) pc = immm4; break;
+				case 4: if( rs1 < rs2 ) pc = immm4; break;
+				case 5: if( rs1 >= rs2 ) pc = immm4; break; //BGE
+				case 6: if( (uint32_t)rs1 < (uint32_t)rs2 ) pc = immm4; break;   //BLTU
+				case 7: if( (uint32_t)rs1 >= (uint32_t)rs2 ) pc = immm4; break;  //BGEU
+				default: trap = (2+1);
+			}
+			break;
+		}
+		case 0x03: // Load (0b0000011)
+		{
+			uint32_t rs1 = REG((ir >> 15) & 0x1f);
+			uint32_t imm = ir >> 20;
+			int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
+			uint32_t rsval = rs1 + imm_se;
+
+			rsval -= MINIRV32_RAM_IMAGE_OFFSET;
+			if( rsval >= MINI_RV32_RAM_SIZE-3 )
+			{
+				rsval += MINIRV32_RAM_IMAGE_OFFSET;
+				if( MINIRV32_MMIO_RANGE( rsval ) )  // UART, CLNT
+				{
+					if( kInBlock ) return EXEC_HANDBACK;	// # MMIO 读也交回: 回调可能要求这一片就此结束 (mmio_yield)
+					MINIRV32_HANDLE_MEM_LOAD_CONTROL( rsval, rval );
+					MINIRV32_MMIO_YIELD( count );
+				}
+				else
+				{
+					trap = (5+1);
+					rval = rsval;
+				}
+			}
+			else
+			{
+				switch( ( ir >> 12 ) & 0x7 )
+				{
+					//LB, LH, LW, LBU, LHU
+					case 0: rval = MINIRV32_LOAD1_SIGNED( rsval ); break;
+					case 1: rval = MINIRV32_LOAD2_SIGNED( rsval ); break;
+					case 2: rval = MINIRV32_LOAD4( rsval ); break;
+					case 4: rval = MINIRV32_LOAD1( rsval ); break;
+					case 5: rval = MINIRV32_LOAD2( rsval ); break;
+					default: trap = (2+1);
+				}
+			}
+			break;
+		}
+		case 0x23: // Store 0b0100011
+		{
+			uint32_t rs1 = REG((ir >> 15) & 0x1f);
+			uint32_t rs2 = REG((ir >> 20) & 0x1f);
+			uint32_t addy = ( ( ir >> 7 ) & 0x1f ) | ( ( ir & 0xfe000000 ) >> 20 );
+			if( addy & 0x800 ) addy |= 0xfffff000;
+			addy += rs1 - MINIRV32_RAM_IMAGE_OFFSET;
+			rdid = 0;
+
+			if( addy >= MINI_RV32_RAM_SIZE-3 )
+			{
+				addy += MINIRV32_RAM_IMAGE_OFFSET;
+				if( MINIRV32_MMIO_RANGE( addy ) )
+				{
+					if( kInBlock ) return EXEC_HANDBACK;
+					MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, rs2 );
+					MINIRV32_MMIO_YIELD( count );
+				}
+				else
+				{
+					trap = (7+1); // Store access fault.
+					rval = addy;
+				}
+			}
+			else
+			{
+				uint32_t funct3 = ( ir >> 12 ) & 0x7;
+				if( funct3 > 2 )
+					trap = (2+1);	// # 非法的 funct3 在查 JIT 页表之前就陷入, 免得按 8 字节去查越过表尾
+				else
+				{
+					uint32_t len = 1u << funct3;
+					if( kInBlock && JitCodeHit( addy, len ) ) return EXEC_HANDBACK;	// # 写到有块的页: 交回来写, 顺便让块失效
+					switch( funct3 )
+					{
+						//SB, SH, SW
+						case 0: MINIRV32_STORE1( addy, rs2 ); break;
+						case 1: MINIRV32_STORE2( addy, rs2 ); break;
+						case 2: MINIRV32_STORE4( addy, rs2 ); break;
+					}
+					JitNotifyStore( addy, len );
+				}
+			}
+			break;
+		}
+		case 0x13: // Op-immediate 0b0010011
+		case 0x33: // Op           0b0110011
+		{
+			uint32_t imm = ir >> 20;
+			imm = imm | (( imm & 0x800 )?0xfffff000:0);
+			uint32_t rs1 = REG((ir >> 15) & 0x1f);
+			uint32_t is_reg = !!( ir & 0x20 );
+			uint32_t rs2 = is_reg ? REG(imm & 0x1f) : imm;
+
+			if( is_reg && ( ir & 0x02000000 ) )
+			{
+				switch( (ir>>12)&7 ) //0x02000000 = RV32M
+				{
+					case 0: rval = rs1 * rs2; break; // MUL
+#ifndef CUSTOM_MULH // If compiling on a system that doesn't natively, or via libgcc support 64-bit math.
+					case 1: rval = ((int64_t)((int32_t)rs1) * (int64_t)((int32_t)rs2)) >> 32; break; // MULH
+					case 2: rval = ((int64_t)((int32_t)rs1) * (uint64_t)rs2) >> 32; break; // MULHSU
+					case 3: rval = ((uint64_t)rs1 * (uint64_t)rs2) >> 32; break; // MULHU
+#else
+					CUSTOM_MULH
+#endif
+					case 4: if( rs2 == 0 ) rval = -1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? rs1 : ((int32_t)rs1 / (int32_t)rs2); break; // DIV
+					case 5: if( rs2 == 0 ) rval = 0xffffffff; else rval = rs1 / rs2; break; // DIVU
+					case 6: if( rs2 == 0 ) rval = rs1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? 0 : ((uint32_t)((int32_t)rs1 % (int32_t)rs2)); break; // REM
+					case 7: if( rs2 == 0 ) rval = rs1; else rval = rs1 % rs2; break; // REMU
+				}
+			}
+			else
+			{
+				switch( (ir>>12)&7 ) // These could be either op-immediate or op commands.  Be careful.
+				{
+					case 0: rval = (is_reg && (ir & 0x40000000) ) ? ( rs1 - rs2 ) : ( rs1 + rs2 ); break;
+					case 1: rval = rs1 << (rs2 & 0x1F); break;
+					case 2: rval = (int32_t)rs1 < (int32_t)rs2; break;
+					case 3: rval = rs1 < rs2; break;
+					case 4: rval = rs1 ^ rs2; break;
+					case 5: rval = (ir & 0x40000000 ) ? ( ((int32_t)rs1) >> (rs2 & 0x1F) ) : ( rs1 >> (rs2 & 0x1F) ); break;
+					case 6: rval = rs1 | rs2; break;
+					case 7: rval = rs1 & rs2; break;
+				}
+			}
+			break;
+		}
+		case 0x0f: // 0b0001111
+			rdid = 0;   // fencetype = (ir >> 12) & 0b111; We ignore fences in this impl.
+			break;
+		case 0x73: // Zifencei+Zicsr  (0b1110011)
+		{
+			uint32_t csrno = ir >> 20;
+			uint32_t microop = ( ir >> 12 ) & 0x7;
+			if( (microop & 3) ) // It's a Zicsr function.
+			{
+				int rs1imm = (ir >> 15) & 0x1f;
+				uint32_t rs1 = REG(rs1imm);
+				uint32_t writeval = rs1;
+
+				// https://raw.githubusercontent.com/riscv/virtual-memory/main/specs/663-Svpbmt.pdf
+				// Generally, support for Zicsr
+				switch( csrno )
+				{
+				case 0x340: rval = CSR( mscratch ); break;
+				case 0x305: rval = CSR( mtvec ); break;
+				case 0x304: rval = CSR( mie ); break;
+				case 0xC00: rval = cycle; break;
+				case 0x344: rval = CSR( mip ); break;
+				case 0x341: rval = CSR( mepc ); break;
+				case 0x300: rval = CSR( mstatus ); break; //mstatus
+				case 0x342: rval = CSR( mcause ); break;
+				case 0x343: rval = CSR( mtval ); break;
+				case 0xf11: rval = 0xff0ff0ff; break; //mvendorid
+				case 0x301: rval = 0x40401101; break; //misa (XLEN=32, IMA+X)
+				//case 0x3B0: rval = 0; break; //pmpaddr0
+				//case 0x3a0: rval = 0; break; //pmpcfg0
+				//case 0xf12: rval = 0x00000000; break; //marchid
+				//case 0xf13: rval = 0x00000000; break; //mimpid
+				//case 0xf14: rval = 0x00000000; break; //mhartid
+				default:
+					MINIRV32_OTHERCSR_READ( csrno, rval );
+					break;
+				}
+
+				switch( microop )
+				{
+					case 1: writeval = rs1; break;  			//CSRRW
+					case 2: writeval = rval | rs1; break;		//CSRRS
+					case 3: writeval = rval & ~rs1; break;		//CSRRC
+					case 5: writeval = rs1imm; break;			//CSRRWI
+					case 6: writeval = rval | rs1imm; break;	//CSRRSI
+					case 7: writeval = rval & ~rs1imm; break;	//CSRRCI
+				}
+
+				switch( csrno )
+				{
+				case 0x340: SETCSR( mscratch, writeval ); break;
+				case 0x305: SETCSR( mtvec, writeval ); break;
+				case 0x304: SETCSR( mie, writeval ); break;
+				case 0x344: SETCSR( mip, writeval ); break;
+				case 0x341: SETCSR( mepc, writeval ); break;
+				case 0x300: SETCSR( mstatus, writeval ); break; //mstatus
+				case 0x342: SETCSR( mcause, writeval ); break;
+				case 0x343: SETCSR( mtval, writeval ); break;
+				//case 0x3a0: break; //pmpcfg0
+				//case 0x3B0: break; //pmpaddr0
+				//case 0xf11: break; //mvendorid
+				//case 0xf12: break; //marchid
+				//case 0xf13: break; //mimpid
+				//case 0xf14: break; //mhartid
+				//case 0x301: break; //misa
+				default:
+					MINIRV32_OTHERCSR_WRITE( csrno, writeval );
+					break;
+				}
+			}
+			else if( microop == 0x0 ) // "SYSTEM" 0b000
+			{
+				rdid = 0;
+				if( ( ( csrno & 0xff ) == 0x02 ) )  // MRET
+				{
+					//https://raw.githubusercontent.com/riscv/virtual-memory/main/specs/663-Svpbmt.pdf
+					//Table 7.6. MRET then in mstatus/mstatush sets MPV=0, MPP=0, MIE=MPIE, and MPIE=1. La
+					// Should also update mstatus to reflect correct mode.
+					uint32_t startmstatus = CSR( mstatus );
+					uint32_t startextraflags = CSR( extraflags );
+					SETCSR( mstatus , (( startmstatus & 0x80) >> 4) | ((startextraflags&3) << 11) | 0x80 );
+					SETCSR( extraflags, (startextraflags & ~3) | ((startmstatus >> 11) & 3) );
+					pc = CSR( mepc ) -4;
+				} else {
+					switch (csrno) {
+					case 0:
+						trap = ( CSR( extraflags ) & 3) ? (11+1) : (8+1); // ECALL; 8 = "Environment call from U-mode"; 11 = "Environment call from M-mode"
+						break;
+					case 1:
+						trap = (3+1); break; // EBREAK 3 = "Breakpoint"
+					case 0x105: //WFI (Wait for interrupts)
+						CSR( mstatus ) |= 8;    //Enable interrupts
+						CSR( extraflags ) |= 4; //Infor environment we want to go to sleep.
+						SETCSR( pc, pc + 4 );
+						return EXEC_WFI;
+					default:
+						trap = (2+1); break; // Illegal opcode.
+					}
+				}
+			}
+			else
+				trap = (2+1); 				// Note micrrop 0b100 == undefined.
+			break;
+		}
+		case 0x2f: // RV32A (0b00101111)
+		{
+			uint32_t rs1 = REG((ir >> 15) & 0x1f);
+			uint32_t rs2 = REG((ir >> 20) & 0x1f);
+			uint32_t irmid = ( ir>>27 ) & 0x1f;
+
+			rs1 -= MINIRV32_RAM_IMAGE_OFFSET;
+
+			// We don't implement load/store from UART or CLNT with RV32A here.
+
+			if( rs1 >= MINI_RV32_RAM_SIZE-3 )
+			{
+				trap = (7+1); //Store/AMO access fault
+				rval = rs1 + MINIRV32_RAM_IMAGE_OFFSET;
+			}
+			else
+			{
+				if( kInBlock && JitCodeHit( rs1, 4 ) ) return EXEC_HANDBACK;
+				rval = MINIRV32_LOAD4( rs1 );
+
+				// Referenced a little bit of https://github.com/franzflasch/riscv_em/blob/master/src/core/core.c
+				uint32_t dowrite = 1;
+				switch( irmid )
+				{
+					case 2: //LR.W (0b00010)
+						dowrite = 0;
+						CSR( extraflags ) = (CSR( extraflags ) & 0x07) | (rs1<<3);
+						break;
+					case 3:  //SC.W (0b00011) (Make sure we have a slot, and, it's valid)
+						rval = ( CSR( extraflags ) >> 3 != ( rs1 & 0x1fffffff ) );  // Validate that our reservation slot is OK.
+						dowrite = !rval; // Only write if slot is valid.
+						break;
+					case 1: break; //AMOSWAP.W (0b00001)
+					case 0: rs2 += rval; break; //AMOADD.W (0b00000)
+					case 4: rs2 ^= rval; break; //AMOXOR.W (0b00100)
+					case 12: rs2 &= rval; break; //AMOAND.W (0b01100)
+					case 8: rs2 |= rval; break; //AMOOR.W (0b01000)
+					case 16: rs2 = ((int32_t)rs2<(int32_t)rval)?rs2:rval; break; //AMOMIN.W (0b10000)
+					case 20: rs2 = ((int32_t)rs2>(int32_t)rval)?rs2:rval; break; //AMOMAX.W (0b10100)
+					case 24: rs2 = (rs2<rval)?rs2:rval; break; //AMOMINU.W (0b11000)
+					case 28: rs2 = (rs2>rval)?rs2:rval; break; //AMOMAXU.W (0b11100)
+					default: trap = (2+1); dowrite = 0; break; //Not supported.
+				}
+				if( dowrite )
+				{
+					MINIRV32_STORE4( rs1, rs2 );
+					JitNotifyStore( rs1, 4 );
+				}
+			}
+			break;
+		}
+		default: trap = (2+1); // Fault: Invalid opcode.
+	}
+
+	// If there was a trap, do NOT allow register writeback.
+	if( trap ) return EXEC_TRAP;
+
+	if( rdid )
+	{
+		REGSET( rdid, rval ); // Write back register.
+	}
+	return EXEC_NEXT;
+}
+
+// JIT 块内不能翻译的指令回调这里. 返回 0 = 已执行(含 rd 写回); 非 0 = 没有产生任何副作用, 块就此结束, 交回解释器执行.
+// 控制流 / SYSTEM / cycle 本来就不会进块 (endsBlock), 陷入的指令在 SingleExec 里也是没有副作用就返回的.
+static int JitHelperExecOne( void * vstate, void * vimage, uint32_t pc, uint32_t ir )
+{
+	struct MiniRV32IMAState * state = (struct MiniRV32IMAState *)vstate;
+	uint32_t trap = 0, rval = 0;
+	int count = 1;
+	if( Rv32iQbeTrans_v01::endsBlock( ir ) ) return 1;
+	return SingleExec<true>( state, (uint8_t *)vimage, pc, ir, 0, trap, rval, count ) != EXEC_NEXT;
+}
+
 int32_t SingleMiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count )
 {
 	uint32_t new_timer = CSR( timerl ) + elapsedUs;		// # 将外部时间片累加到自身
@@ -31,6 +426,10 @@ int32_t SingleMiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image,
 	else
 		CSR( mip ) &= ~(1<<7);
 
+	// # MEIP 由 shell 按 PLIC 的状态维护, 挂着时同样唤醒 WFI
+	if( CSR( mip ) & (1<<11) )
+		CSR( extraflags ) &= ~4;
+
 	// If WFI, don't run processor.
 	if( CSR( extraflags ) & 4 )
 		return 1;
@@ -40,10 +439,11 @@ int32_t SingleMiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image,
 	uint32_t pc = CSR( pc );		// # 这里的pc是下一条即将要执行的指令的地址
 	uint32_t cycle = CSR( cyclel );
 
-	if( ( CSR( mip ) & (1<<7) ) && ( CSR( mie ) & (1<<7) /*mtie*/ ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
+	uint32_t irq = CSR( mip ) & CSR( mie ) & ( (1<<11) | (1<<7) );	// # MEIE / MTIE
+	if( irq && ( CSR( mstatus ) & 0x8 /*mie*/) )
 	{
-		// Timer interrupt.
-		trap = 0x80000007;
+		// # 外部中断 (PLIC) 优先于定时器中断
+		trap = ( irq & (1<<11) ) ? 0x8000000b : 0x80000007;
 		pc -= 4;	// # 后文中, 中断会和正常指令一样, 经历"完成当前指令后" +4的行为
 					// # 但是由于中断本质上没有实际上执行, 所以要提前-4
 					// # 对于异常而言, 由于提前break离开了, 不会经历+4的过程, 所以也是当前指令进入mepc
@@ -70,375 +470,68 @@ int32_t SingleMiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image,
 		else
 		{
 			ir = MINIRV32_LOAD4( ofs_pc );		// # MINIRV32_LOAD4 宏会处理大小端/字节组合
-			uint32_t rdid = (ir >> 7) & 0x1f;	// # 解析出 rd 寄存器编号 (写回目标)
-
-			// ===== 新增 JIT 路径 =====
-			{
-				static std::unordered_map<uint32_t, JitEntry> jit_cache;
-
-				auto it = jit_cache.find(pc);
-				if(it == jit_cache.end()) {
-					// 没有缓存，构建新的 JIT 函数
-					Rv32iQbeTrans_v01 tr;
-					std::string name = qbejit::pc_to_name(pc);
-					tr.init(name);
-
-					bool allow_mem = true;
-					if ((ir & 0x7F) == 0x03 || (ir & 0x7F) == 0x23) {
-						uint32_t ea = 0; // TODO: compute_effective_addr(ir, state->regs...)
-						allow_mem = MemMapV01::is_ram_addr(ea);
-					}
-
-					auto piece = tr.translateOne(ir, allow_mem);
-					if(piece) {
-						tr.commit(*piece);
-						std::string ssa = tr.finalize();
-
-						std::string parent = qbejit::default_parent();
-						std::string name   = qbejit::pc_to_name(pc);
-						auto P = qbejit::make_paths(parent, name);
-
-						qbejit::build_so(parent, name, ssa);
-						auto [h, fn] = qbejit::load_fn(parent, name);
-
-						jit_cache[pc] = JitEntry{ std::move(h), fn };
-						it = jit_cache.find(pc);
-					}
-				}
 
-				if(it != jit_cache.end()) {
-					// 调用 JIT 生成的函数
-					int rc = it->second.fn(state, image, pc);
-					if(rc == 0) {
-						pc += 4;
-						continue; // 已执行，直接进入下一轮
-					}
-				}
-			}
-
-			switch( ir & 0x7f )
+			// ===== JIT 路径 ===== (qbe 不可用时整个关掉, 之后纯解释执行)
+			if( !jit_broken )
 			{
-				case 0x37: // LUI (0b0110111)
-					rval = ( ir & 0xfffff000 );
-					break;
-				case 0x17: // AUIPC (0b0010111)
-					rval = pc + ( ir & 0xfffff000 );
-					break;
-				case 0x6F: // JAL (0b1101111)
-				{
-					int32_t reladdy = ((ir & 0x80000000)>>11) | ((ir & 0x7fe00000)>>20) | ((ir & 0x00100000)>>9) | ((ir&0x000ff000));
-					if( reladdy & 0x00100000 ) reladdy |= 0xffe00000; // Sign extension.
-					rval = pc + 4;
-					pc = pc + reladdy - 4;
-					break;
-				}
-				case 0x67: // JALR (0b1100111)
-				{
-					uint32_t imm = ir >> 20;
-					int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
-					rval = pc + 4;
-					pc = ( (REG( (ir >> 15) & 0x1f ) + imm_se) & ~1) - 4;
-					break;
-				}
-				case 0x63: // Branch (0b1100011)
-				{
-					uint32_t immm4 = ((ir & 0xf00)>>7) | ((ir & 0x7e000000)>>20) | ((ir & 0x80) << 4) | ((ir >> 31)<<12);
-					if( immm4 & 0x1000 ) immm4 |= 0xffffe000;
-					int32_t rs1 = REG((ir >> 15) & 0x1f);
-					int32_t rs2 = REG((ir >> 20) & 0x1f);
-					immm4 = pc + immm4 - 4;
-					rdid = 0;
-					switch( ( ir >> 12 ) & 0x7 )
-					{
-						// BEQ, BNE, BLT, BGE, BLTU, BGEU
-						case 0: if( rs1 == rs2 ) pc = immm4; break;
-						case 1: if( rs1 != rs2 ) pc = immm4; break;
-						case 4: if( rs1 < rs2 ) pc = immm4; break;
-						case 5: if( rs1 >= rs2 ) pc = immm4; break; //BGE
-						case 6: if( (uint32_t)rs1 < (uint32_t)rs2 ) pc = immm4; break;   //BLTU
-						case 7: if( (uint32_t)rs1 >= (uint32_t)rs2 ) pc = immm4; break;  //BGEU
-						default: trap = (2+1);
-					}
-					break;
-				}
-				case 0x03: // Load (0b0000011)
-				{
-					uint32_t rs1 = REG((ir >> 15) & 0x1f);
-					uint32_t imm = ir >> 20;
-					int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
-					uint32_t rsval = rs1 + imm_se;
-
-					rsval -= MINIRV32_RAM_IMAGE_OFFSET;
-					if( rsval >= MINI_RV32_RAM_SIZE-3 )
-					{
-						rsval += MINIRV32_RAM_IMAGE_OFFSET;
-						if( MINIRV32_MMIO_RANGE( rsval ) )  // UART, CLNT
-						{
-							MINIRV32_HANDLE_MEM_LOAD_CONTROL( rsval, rval );
-						}
-						else
-						{
-							trap = (5+1);
-							rval = rsval;
-						}
-					}
-					else
-					{
-						switch( ( ir >> 12 ) & 0x7 )
-						{
-							//LB, LH, LW, LBU, LHU
-							case 0: rval = MINIRV32_LOAD1_SIGNED( rsval ); break;
-							case 1: rval = MINIRV32_LOAD2_SIGNED( rsval ); break;
-							case 2: rval = MINIRV32_LOAD4( rsval ); break;
-							case 4: rval = MINIRV32_LOAD1( rsval ); break;
-							case 5: rval = MINIRV32_LOAD2( rsval ); break;
-							default: trap = (2+1);
-						}
-					}
-					break;
-				}
-				case 0x23: // Store 0b0100011
+				if( !jit_code_pages )
 				{
-					uint32_t rs1 = REG((ir >> 15) & 0x1f);
-					uint32_t rs2 = REG((ir >> 20) & 0x1f);
-					uint32_t addy = ( ( ir >> 7 ) & 0x1f ) | ( ( ir & 0xfe000000 ) >> 20 );
-					if( addy & 0x800 ) addy |= 0xfffff000;
-					addy += rs1 - MINIRV32_RAM_IMAGE_OFFSET;
-					rdid = 0;
-
-					if( addy >= MINI_RV32_RAM_SIZE-3 )
-					{
-						addy += MINIRV32_RAM_IMAGE_OFFSET;
-						if( MINIRV32_MMIO_RANGE( addy ) )
-						{
-							MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, rs2 );
-						}
-						else
-						{
-							trap = (7+1); // Store access fault.
-							rval = addy;
-						}
-					}
-					else
-					{
-						switch( ( ir >> 12 ) & 0x7 )
-						{
-							//SB, SH, SW
-							case 0: MINIRV32_STORE1( addy, rs2 ); break;
-							case 1: MINIRV32_STORE2( addy, rs2 ); break;
-							case 2: MINIRV32_STORE4( addy, rs2 ); break;
-							default: trap = (2+1);
-						}
-					}
-					break;
-				}
-				case 0x13: // Op-immediate 0b0010011
-				case 0x33: // Op           0b0110011
-				{
-					uint32_t imm = ir >> 20;
-					imm = imm | (( imm & 0x800 )?0xfffff000:0);
-					uint32_t rs1 = REG((ir >> 15) & 0x1f);
-					uint32_t is_reg = !!( ir & 0x20 );
-					uint32_t rs2 = is_reg ? REG(imm & 0x1f) : imm;
-
-					if( is_reg && ( ir & 0x02000000 ) )
-					{
-						switch( (ir>>12)&7 ) //0x02000000 = RV32M
-						{
-							case 0: rval = rs1 * rs2; break; // MUL
-#ifndef CUSTOM_MULH // If compiling on a system that doesn't natively, or via libgcc support 64-bit math.
-							case 1: rval = ((int64_t)((int32_t)rs1) * (int64_t)((int32_t)rs2)) >> 32; break; // MULH
-							case 2: rval = ((int64_t)((int32_t)rs1) * (uint64_t)rs2) >> 32; break; // MULHSU
-							case 3: rval = ((uint64_t)rs1 * (uint64_t)rs2) >> 32; break; // MULHU
-#else
-							CUSTOM_MULH
-#endif
-							case 4: if( rs2 == 0 ) rval = -1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? rs1 : ((int32_t)rs1 / (int32_t)rs2); break; // DIV
-							case 5: if( rs2 == 0 ) rval = 0xffffffff; else rval = rs1 / rs2; break; // DIVU
-							case 6: if( rs2 == 0 ) rval = rs1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? 0 : ((uint32_t)((int32_t)rs1 % (int32_t)rs2)); break; // REM
-							case 7: if( rs2 == 0 ) rval = rs1; else rval = rs1 % rs2; break; // REMU
-						}
-					}
-					else
-					{
-						switch( (ir>>12)&7 ) // These could be either op-immediate or op commands.  Be careful.
-						{
-							case 0: rval = (is_reg && (ir & 0x40000000) ) ? ( rs1 - rs2 ) : ( rs1 + rs2 ); break;
-							case 1: rval = rs1 << (rs2 & 0x1F); break;
-							case 2: rval = (int32_t)rs1 < (int32_t)rs2; break;
-							case 3: rval = rs1 < rs2; break;
-							case 4: rval = rs1 ^ rs2; break;
-							case 5: rval = (ir & 0x40000000 ) ? ( ((int32_t)rs1) >> (rs2 & 0x1F) ) : ( rs1 >> (rs2 & 0x1F) ); break;
-							case 6: rval = rs1 | rs2; break;
-							case 7: rval = rs1 & rs2; break;
-						}
-					}
-					break;
+					jit_npages = ( MINI_RV32_RAM_SIZE + ( 1u << JIT_PAGE_SHIFT ) - 1 ) >> JIT_PAGE_SHIFT;
+					jit_pages.resize( jit_npages );
+					jit_code_pages = (uint8_t *)calloc( jit_npages, 1 );
 				}
-				case 0x0f: // 0b0001111
-					rdid = 0;   // fencetype = (ir >> 12) & 0b111; We ignore fences in this impl.
-					break;
-				case 0x73: // Zifencei+Zicsr  (0b1110011)
-				{
-					uint32_t csrno = ir >> 20;
-					uint32_t microop = ( ir >> 12 ) & 0x7;
-					if( (microop & 3) ) // It's a Zicsr function.
-					{
-						int rs1imm = (ir >> 15) & 0x1f;
-						uint32_t rs1 = REG(rs1imm);
-						uint32_t writeval = rs1;
-
-						// https://raw.githubusercontent.com/riscv/virtual-memory/main/specs/663-Svpbmt.pdf
-						// Generally, support for Zicsr
-						switch( csrno )
-						{
-						case 0x340: rval = CSR( mscratch ); break;
-						case 0x305: rval = CSR( mtvec ); break;
-						case 0x304: rval = CSR( mie ); break;
-						case 0xC00: rval = cycle; break;
-						case 0x344: rval = CSR( mip ); break;
-						case 0x341: rval = CSR( mepc ); break;
-						case 0x300: rval = CSR( mstatus ); break; //mstatus
-						case 0x342: rval = CSR( mcause ); break;
-						case 0x343: rval = CSR( mtval ); break;
-						case 0xf11: rval = 0xff0ff0ff; break; //mvendorid
-						case 0x301: rval = 0x40401101; break; //misa (XLEN=32, IMA+X)
-						//case 0x3B0: rval = 0; break; //pmpaddr0
-						//case 0x3a0: rval = 0; break; //pmpcfg0
-						//case 0xf12: rval = 0x00000000; break; //marchid
-						//case 0xf13: rval = 0x00000000; break; //mimpid
-						//case 0xf14: rval = 0x00000000; break; //mhartid
-						default:
-							MINIRV32_OTHERCSR_READ( csrno, rval );
-							break;
-						}
-
-						switch( microop )
-						{
-							case 1: writeval = rs1; break;  			//CSRRW
-							case 2: writeval = rval | rs1; break;		//CSRRS
-							case 3: writeval = rval & ~rs1; break;		//CSRRC
-							case 5: writeval = rs1imm; break;			//CSRRWI
-							case 6: writeval = rval | rs1imm; break;	//CSRRSI
-							case 7: writeval = rval & ~rs1imm; break;	//CSRRCI
-						}
 
-						switch( csrno )
-						{
-						case 0x340: SETCSR( mscratch, writeval ); break;
-						case 0x305: SETCSR( mtvec, writeval ); break;
-						case 0x304: SETCSR( mie, writeval ); break;
-						case 0x344: SETCSR( mip, writeval ); break;
-						case 0x341: SETCSR( mepc, writeval ); break;
-						case 0x300: SETCSR( mstatus, writeval ); break; //mstatus
-						case 0x342: SETCSR( mcause, writeval ); break;
-						case 0x343: SETCSR( mtval, writeval ); break;
-						//case 0x3a0: break; //pmpcfg0
-						//case 0x3B0: break; //pmpaddr0
-						//case 0xf11: break; //mvendorid
-						//case 0xf12: break; //marchid
-						//case 0xf13: break; //mimpid
-						//case 0xf14: break; //mhartid
-						//case 0x301: break; //misa
-						default:
-							MINIRV32_OTHERCSR_WRITE( csrno, writeval );
-							break;
-						}
-					}
-					else if( microop == 0x0 ) // "SYSTEM" 0b000
-					{
-						rdid = 0;
-						if( ( ( csrno & 0xff ) == 0x02 ) )  // MRET
-						{
-							//https://raw.githubusercontent.com/riscv/virtual-memory/main/specs/663-Svpbmt.pdf
-							//Table 7.6. MRET then in mstatus/mstatush sets MPV=0, MPP=0, MIE=MPIE, and MPIE=1. La
-							// Should also update mstatus to reflect correct mode.
-							uint32_t startmstatus = CSR( mstatus );
-							uint32_t startextraflags = CSR( extraflags );
-							SETCSR( mstatus , (( startmstatus & 0x80) >> 4) | ((startextraflags&3) << 11) | 0x80 );
-							SETCSR( extraflags, (startextraflags & ~3) | ((startmstatus >> 11) & 3) );
-							pc = CSR( mepc ) -4;
-						} else {
-							switch (csrno) {
-							case 0:
-								trap = ( CSR( extraflags ) & 3) ? (11+1) : (8+1); // ECALL; 8 = "Environment call from U-mode"; 11 = "Environment call from M-mode"
-								break;
-							case 1:
-								trap = (3+1); break; // EBREAK 3 = "Breakpoint"
-							case 0x105: //WFI (Wait for interrupts)
-								CSR( mstatus ) |= 8;    //Enable interrupts
-								CSR( extraflags ) |= 4; //Infor environment we want to go to sleep.
-								SETCSR( pc, pc + 4 );
-								return 1;
-							default:
-								trap = (2+1); break; // Illegal opcode.
-							}
+				uint32_t page = ofs_pc >> JIT_PAGE_SHIFT;
+				auto & blocks = jit_pages[page];
+				auto it = blocks.find(pc);
+				if(it == blocks.end()) {
+					// 没有缓存，构建新的 JIT 块: 一直翻译到控制流指令或者页尾为止, 不支持的指令在块内走 helper
+					// 翻译不出来 (第一条就是控制流) 也记下来 (fn = nullptr), 之后不再重复尝试
+					JitEntry e{};
+					Rv32iQbeTrans_v01 tr;
+					std::string name = qbejit::pc_to_name(pc) + "_" + std::to_string(jit_builds++);
+					tr.init(name, pc, MINI_RV32_RAM_SIZE, jit_code_pages);
+					uint32_t page_end = ( page + 1 ) << JIT_PAGE_SHIFT;
+					for( uint32_t ofs = ofs_pc; ofs < page_end && ofs < MINI_RV32_RAM_SIZE - 3; ofs += 4 )
+						if( !tr.append( MINIRV32_LOAD4( ofs ) ) ) break;
+
+					if( tr.length() > 0 ) {
+						try {
+							std::string parent = qbejit::default_parent();
+							qbejit::build_so(parent, name, tr.finalize());
+							auto [h, fn] = qbejit::load_fn(parent, name);
+							e = JitEntry{ std::move(h), fn, tr.length() };
+							jit_code_pages[page] = 1;	// # 只有真正生成了代码的页才需要在写入时失效
+						} catch( const std::exception & ex ) {
+							fprintf( stderr, "JIT: falling back to interpreter (%s)\n", ex.what() );
+							jit_broken = 1;
 						}
 					}
-					else
-						trap = (2+1); 				// Note micrrop 0b100 == undefined.
-					break;
+					it = blocks.emplace(pc, std::move(e)).first;
 				}
-				case 0x2f: // RV32A (0b00101111)
-				{
-					uint32_t rs1 = REG((ir >> 15) & 0x1f);
-					uint32_t rs2 = REG((ir >> 20) & 0x1f);
-					uint32_t irmid = ( ir>>27 ) & 0x1f;
 
-					rs1 -= MINIRV32_RAM_IMAGE_OFFSET;
-
-					// We don't implement load/store from UART or CLNT with RV32A here.
-
-					if( rs1 >= MINI_RV32_RAM_SIZE-3 )
-					{
-						trap = (7+1); //Store/AMO access fault
-						rval = rs1 + MINIRV32_RAM_IMAGE_OFFSET;
-					}
-					else
-					{
-						rval = MINIRV32_LOAD4( rs1 );
-
-						// Referenced a little bit of https://github.com/franzflasch/riscv_em/blob/master/src/core/core.c
-						uint32_t dowrite = 1;
-						switch( irmid )
-						{
-							case 2: //LR.W (0b00010)
-								dowrite = 0;
-								CSR( extraflags ) = (CSR( extraflags ) & 0x07) | (rs1<<3);
-								break;
-							case 3:  //SC.W (0b00011) (Make sure we have a slot, and, it's valid)
-								rval = ( CSR( extraflags ) >> 3 != ( rs1 & 0x1fffffff ) );  // Validate that our reservation slot is OK.
-								dowrite = !rval; // Only write if slot is valid.
-								break;
-							case 1: break; //AMOSWAP.W (0b00001)
-							case 0: rs2 += rval; break; //AMOADD.W (0b00000)
-							case 4: rs2 ^= rval; break; //AMOXOR.W (0b00100)
-							case 12: rs2 &= rval; break; //AMOAND.W (0b01100)
-							case 8: rs2 |= rval; break; //AMOOR.W (0b01000)
-							case 16: rs2 = ((int32_t)rs2<(int32_t)rval)?rs2:rval; break; //AMOMIN.W (0b10000)
-							case 20: rs2 = ((int32_t)rs2>(int32_t)rval)?rs2:rval; break; //AMOMAX.W (0b10100)
-							case 24: rs2 = (rs2<rval)?rs2:rval; break; //AMOMINU.W (0b11000)
-							case 28: rs2 = (rs2>rval)?rs2:rval; break; //AMOMAXU.W (0b11100)
-							default: trap = (2+1); dowrite = 0; break; //Not supported.
-						}
-						if( dowrite ) MINIRV32_STORE4( rs1, rs2 );
+				// 整块执行不能超出本次的指令预算 (-s 单步时自然退回解释器)
+				if( it->second.fn && it->second.len <= count - icount ) {
+					// 调用 JIT 生成的函数, 返回实际执行的条数; 0 说明第一条就要交给解释器
+					int n = it->second.fn(state, image, pc, JitHelperExecOne);
+					if(n > 0) {
+						pc += 4 * n;
+						cycle += n - 1;		// # 本轮开头已经 cycle++ 过一次
+						icount += n - 1;
+						continue; // 已执行，直接进入下一轮
 					}
-					break;
 				}
-				default: trap = (2+1); // Fault: Invalid opcode.
 			}
 
-			// If there was a trap, do NOT allow register writeback.
+			int r = SingleExec<false>( state, image, pc, ir, cycle, trap, rval, count );
+			if( r == EXEC_WFI ) return 1;
+			if( r == EXEC_SYSCON ) return rval;
+
 			if( trap ) {
 				SETCSR( pc, pc );
 				MINIRV32_POSTEXEC( pc, ir, trap );
 				break;
 			}
-
-			if( rdid )
-			{
-				REGSET( rdid, rval ); // Write back register.
-			}
 		}
 
 		MINIRV32_POSTEXEC( pc, ir, trap );
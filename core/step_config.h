@@ -0,0 +1,72 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef STEP_CONFIG_H
+#define STEP_CONFIG_H
+
+#include "core.h"
+#include "bus.h"
+
+// # 预解码引擎的编译期配置. step 函数是以 Config 为参数的模板, 关掉的功能在热循环里不留任何分支:
+// #   - 陷入时是交给 HandleException 继续跑, 还是直接打印 FAULT 停机 (-d)
+// #   - RAM 大小: 非 0 时是编译期常数, 边界检查直接和立即数比较; 0 表示运行时读 ram_amt
+// #   - 是否逐条打印执行轨迹 (-x)
+// #   - 访存策略 Bus (bus.h, -B)
+// # 由 shell 调用一次 MiniRV32IMASelectStep 选出实例, 之后 step 里不再看任何全局开关.
+
+enum FaultPolicy
+{
+	FAULT_HANDLE,	// # 交给 HandleException, 然后跳到 mtvec
+	FAULT_STOP,		// # 打印 FAULT, step 返回 3
+};
+
+template< FaultPolicy Fault, uint32_t RamSize, bool Trace, class BusT = FlatBus >
+struct StepConfig
+{
+	static constexpr FaultPolicy kFault = Fault;
+	static constexpr uint32_t kRamSize = RamSize;
+	static constexpr bool kTrace = Trace;
+	typedef BusT Bus;
+
+	static inline uint32_t ram_size() { return kRamSize ? kRamSize : ram_amt; }
+};
+
+#define STEP_DEFAULT_RAM_SIZE	( 64 * 1024 * 1024 )
+
+// # 每个引擎都实例化的配置组合: X( engine_name, fn, fault, ram_size, trace, bus )
+// # 调试用的 bus 只配运行时 RAM 大小的实例
+#define STEP_CONFIGS( X, name, fn ) \
+	X( name, fn, FAULT_HANDLE, STEP_DEFAULT_RAM_SIZE, false, FlatBus ) \
+	X( name, fn, FAULT_HANDLE, 0, false, FlatBus ) \
+	X( name, fn, FAULT_STOP, STEP_DEFAULT_RAM_SIZE, false, FlatBus ) \
+	X( name, fn, FAULT_STOP, 0, false, FlatBus ) \
+	X( name, fn, FAULT_HANDLE, 0, true, FlatBus ) \
+	X( name, fn, FAULT_STOP, 0, true, FlatBus ) \
+	X( name, fn, FAULT_HANDLE, 0, false, CheckedBus ) \
+	X( name, fn, FAULT_STOP, 0, false, CheckedBus ) \
+	X( name, fn, FAULT_HANDLE, 0, false, TracingBus<FlatBus> ) \
+	X( name, fn, FAULT_STOP, 0, false, TracingBus<FlatBus> ) \
+	X( name, fn, FAULT_HANDLE, 0, false, PagedBus ) \
+	X( name, fn, FAULT_STOP, 0, false, PagedBus )
+
+#define STEP_INSTANTIATE_ONE( name, fn, fault, ram, trace, bus ) \
+	template int32_t fn< StepConfig< fault, ram, trace, bus > >( struct MiniRV32IMAState *, uint8_t *, uint32_t, uint32_t, int );
+#define STEP_INSTANTIATE( name, fn )	STEP_CONFIGS( STEP_INSTANTIATE_ONE, name, fn )
+
+// # guard 模式 (-g) 的实例
+#define STEP_GUARD_CONFIGS( X, name, fn ) \
+	X( name, fn, FAULT_HANDLE, STEP_DEFAULT_RAM_SIZE, false, GuardBus ) \
+	X( name, fn, FAULT_HANDLE, 0, false, GuardBus ) \
+	X( name, fn, FAULT_STOP, STEP_DEFAULT_RAM_SIZE, false, GuardBus ) \
+	X( name, fn, FAULT_STOP, 0, false, GuardBus )
+#define STEP_INSTANTIATE_GUARD( name, fn )	STEP_GUARD_CONFIGS( STEP_INSTANTIATE_ONE, name, fn )
+
+// # 各预解码引擎的模板, 定义和实例化在各自的 .cpp 里 (decoded_step.h)
+#define STEP_DECLARE( fn ) \
+	template< class Config > int32_t fn( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count );
+STEP_DECLARE( DecodedStep )
+STEP_DECLARE( ThreadedStep )
+#undef STEP_DECLARE
+
+#endif //STEP_CONFIG_H
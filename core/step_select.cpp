@@ -0,0 +1,66 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#include "step_config.h"
+#include "guard.h"
+
+#include <cstring>
+
+// # -B 用的名字
+template< class Bus > struct BusName;
+template<> struct BusName< FlatBus > { static constexpr const char * label = "flat"; };
+template<> struct BusName< CheckedBus > { static constexpr const char * label = "checked"; };
+template<> struct BusName< TracingBus<FlatBus> > { static constexpr const char * label = "trace"; };
+template<> struct BusName< PagedBus > { static constexpr const char * label = "paged"; };
+template<> struct BusName< GuardBus > { static constexpr const char * label = "guard"; };
+
+struct StepVariant
+{
+	const char * engine;
+	FaultPolicy fault;
+	uint32_t ram_size;	// # 0 = 运行时大小, 任何 ram_amt 都能用
+	bool trace;
+	const char * bus;
+	MiniRV32IMAStepFn step;
+};
+
+#define STEP_VARIANT( name, fn, fault, ram, trace, bus ) { name, fault, ram, trace, BusName< bus >::label, fn< StepConfig< fault, ram, trace, bus > > },
+#define STEP_GUARD_VARIANT( name, fn, fault, ram, trace, bus ) { name, fault, ram, trace, BusName< bus >::label, GuardEnter< fn< StepConfig< fault, ram, trace, bus > > > },
+static const StepVariant step_variants[] = {
+	STEP_CONFIGS( STEP_VARIANT, "decoded", DecodedStep )
+	STEP_CONFIGS( STEP_VARIANT, "threaded", ThreadedStep )
+	STEP_GUARD_CONFIGS( STEP_GUARD_VARIANT, "decoded", DecodedStep )
+	STEP_GUARD_CONFIGS( STEP_GUARD_VARIANT, "threaded", ThreadedStep )
+};
+#undef STEP_VARIANT
+#undef STEP_GUARD_VARIANT
+
+// # 没有模板化的引擎, 运行时读全局开关. 它们自己做完整的范围检查, 所以在 guard 模式分配的 RAM 上也能跑
+static const struct
+{
+	const char * name;
+	MiniRV32IMAStepFn step;
+} plain_engines[] = {
+	{ "old", MiniRV32IMAStep },
+	{ "my", MyMiniRV32IMAStep },
+	{ "jit", SingleMiniRV32IMAStep },
+};
+
+MiniRV32IMAStepFn MiniRV32IMASelectStep( const char * engine, const char * bus, int fail_on_faults, uint32_t ram_size, int trace )
+{
+	for( const auto & p : plain_engines )
+		if( strcmp( p.name, engine ) == 0 )
+			return ( trace || ( strcmp( bus, "flat" ) != 0 && strcmp( bus, "guard" ) != 0 ) ) ? 0 : p.step;
+
+	// # RAM 大小正好是某个编译期常数时优先用那个实例, 否则用运行时大小的实例
+	FaultPolicy fault = fail_on_faults ? FAULT_STOP : FAULT_HANDLE;
+	MiniRV32IMAStepFn found = 0;
+	for( const auto & v : step_variants )
+	{
+		if( strcmp( v.engine, engine ) != 0 || strcmp( v.bus, bus ) != 0 || v.fault != fault || v.trace != !!trace ) continue;
+		if( v.ram_size == ram_size ) return v.step;
+		if( v.ram_size == 0 ) found = v.step;
+	}
+	return found;
+}
@@ -0,0 +1,13 @@
+//
+// Created by liujilan on 25-10-19.
+//
+
+// # 直接线索化(direct-threaded)解释器: 与 decoded_core.cpp 共用预解码缓存和 step 函数体,
+// # 但每个完全特化的 handler 末尾都有自己的 goto *dispatch[...] (GCC labels-as-values),
+// # 间接跳转分散到各个 handler 上, 分支预测器可以按"上一条是什么指令"分别预测.
+#define DECODED_STEP_NAME		ThreadedStep
+#define DECODED_STEP_THREADED	1
+#include "decoded_step.h"
+
+STEP_INSTANTIATE( threaded, ThreadedStep )
+STEP_INSTANTIATE_GUARD( threaded, ThreadedStep )
@@ -11,20 +11,24 @@
 // uint4's.  We are going to uint4 data to/from system RAM.
 //
 // We're going to try to keep the full processor state to 12 x uint4.
+// # 状态放在宿主内存里 (shell 单独按 64 字节对齐分配), 不再占用 guest RAM 的末尾.
+// # 热字段在前: regs 必须在偏移 0 (JIT 按 4*N 访问), cyclel / cycleh 必须相邻 (shell 当作 uint64 读写).
+// # 只在陷入 / CSR 指令里用到的冷字段从下一条 cache line 开始.
 struct MiniRV32IMAState
 {
     uint32_t regs[32];
 
     uint32_t pc;
-    uint32_t mstatus;
     uint32_t cyclel;
     uint32_t cycleh;
 
-    uint32_t timerl;
-    uint32_t timerh;
-    uint32_t timermatchl;
-    uint32_t timermatchh;
+    // Note: only a few bits are used.  (Machine = 3, User = 0)
+    // Bits 0..1 = privilege.
+    // Bit 2 = WFI (Wait for interrupt)
+    // Bit 3+ = Load/Store reservation LSBs.
+    uint32_t extraflags;
 
+    uint32_t mstatus __attribute__((aligned(64)));
     uint32_t mscratch;
     uint32_t mtvec;
     uint32_t mie;
@@ -34,12 +38,11 @@ struct MiniRV32IMAState
     uint32_t mtval;
     uint32_t mcause;
 
-    // Note: only a few bits are used.  (Machine = 3, User = 0)
-    // Bits 0..1 = privilege.
-    // Bit 2 = WFI (Wait for interrupt)
-    // Bit 3+ = Load/Store reservation LSBs.
-    uint32_t extraflags;
-};
+    uint32_t timerl;
+    uint32_t timerh;
+    uint32_t timermatchl;
+    uint32_t timermatchh;
+} __attribute__((aligned(64)));
 
 #ifndef MINIRV32_CUSTOM_INTERNALS
 #define CSR( x ) state->x
@@ -48,6 +51,13 @@ struct MiniRV32IMAState
 #define REGSET( x, val ) { state->regs[x] = val; }
 #endif
 
+// # 所有 step 引擎的统一签名, shell.c 通过它选择引擎
+typedef int32_t (*MiniRV32IMAStepFn)(struct MiniRV32IMAState* state,
+                                     uint8_t* image,
+                                     uint32_t vProcAddress,
+                                     uint32_t elapsedUs,
+                                     int count);
+
 // # 即使是纯C函数, 也要extern "C", 否则 C++ 会把它们当成 C++ 符号
 #ifdef __cplusplus
 extern "C" {
@@ -71,6 +81,25 @@ extern "C" {
                               uint32_t elapsedUs,
                               int count);
 
+    // # 按引擎名选出 step 函数 (old / my / jit / decoded / threaded), 未知引擎或不支持的组合返回 0.
+    // # 预解码引擎按 bus / fault / ram_size / trace 选出编译期特化的实例 (见 core/step_config.h, core/bus.h);
+    // # old / my / jit 仍在运行时读 fail_on_all_faults 和 ram_amt, 只支持 flat bus, 不支持 trace.
+    MiniRV32IMAStepFn MiniRV32IMASelectStep(const char* engine, const char* bus, int fail_on_faults, uint32_t ram_size, int trace);
+
+    // # guard 模式 (-g): 保留 4GiB 地址空间并把 RAM 映射在 guest 偏移处, 返回 RAM 起点; 不支持时返回 0.
+    // # 配合 bus "guard" 使用 (decoded / threaded), 见 core/guard.h; hugetlb 同 HostRamAlloc (shell/hostmem.h)
+    uint8_t* MiniRV32IMAGuardAlloc(uint32_t ram_size, int hugetlb);
+
+    // # 告诉 bus guest RAM 在哪里 (PagedBus 据此建页表), 分配好 RAM 之后调用一次
+    void MiniRV32IMAAttachRam(uint8_t* image, uint32_t size);
+
+    // # 预解码缓存和 JIT 块缓存的失效接口: 外部(镜像重新装载 / DMA)改写了 RAM 时调用
+    void MiniRV32IMAInvalidateDecoded(uint32_t ofs, uint32_t len);
+    void MiniRV32IMAFlushDecoded();
+
+    // # 把各种融合指令对的执行次数打到 stderr; retired 为退休的指令总数, 用来算占比
+    void MiniRV32IMAReportFusion(uint64_t retired);
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,6 +17,8 @@ extern uint32_t ram_amt;		// # 模拟的内存大小
 extern int fail_on_all_faults;	// # Flag, 用于解读-d指令, 如果为 1 则大循环立刻报错停机;
 								// # 否则进入HandleException后原地返回(可以在hook里处理些东西)
 								// # 这之后直接继续在内部转跳到 mtvec 的逻辑
+extern int mmio_yield;			// # MMIO 回调置 1 表示这条指令执行完就结束 step (比如刚挂上了外部中断),
+								// # 引擎只在 MMIO 慢路径上看它, 热路径上不用管; shell 在每次 step 之前清零
 
 #ifdef __cplusplus
 extern "C" {
@@ -56,9 +58,12 @@ extern "C" {
 #endif
 
 #ifndef MINIRV32_MMIO_RANGE
-	#define MINIRV32_MMIO_RANGE(n)  (0x10000000 <= (n) && (n) < 0x12000000)
+	#define MINIRV32_MMIO_RANGE(n)  (0x0c000000 <= (n) && (n) < 0x12000000)	// # 设备窗口, 和 shell/mmio.h 一致; 具体的设备在那里登记
 #endif
 
+// # MMIO 回调之后: 回调要求让出时把剩余预算清零, 这条指令执行完 step 照常结束 (pc, cycle 都写回)
+#define MINIRV32_MMIO_YIELD( count )	{ if( mmio_yield ) count = 0; }
+
 #ifndef MINIRV32_CUSTOM_MEMORY_BUS
 	#define MINIRV32_STORE4( ofs, val ) *(uint32_t*)(image + ofs) = val
 	#define MINIRV32_STORE2( ofs, val ) *(uint16_t*)(image + ofs) = val
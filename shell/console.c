@@ -0,0 +1,197 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#define _GNU_SOURCE	// # fopencookie
+#include "console.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define CONSOLE_RING	( 1u << 20 )				// # 2 的幂
+#define CONSOLE_HIGH	( CONSOLE_RING / 4 * 3 )	// # 攒到这么多就叫醒写线程
+
+static uint8_t ring[CONSOLE_RING];
+static _Atomic uint32_t head;	// # 生产者 (模拟线程) 写到哪里, 只增不减, 用时取模
+static _Atomic uint32_t tail;	// # 写线程写到哪里
+static uint32_t kicked;			// # 上次叫醒写线程时的 head, 只有生产者用
+
+static pthread_t writer;
+static sem_t data_sem;			// # 叫醒写线程
+static sem_t space_sem;			// # 缓冲区满时生产者在这里等
+static atomic_int writer_idle;	// # 写线程在 (或者正要) 等 data_sem, 生产者这时才需要 post
+static atomic_int producer_waiting;
+static atomic_int stopping;
+static int running;
+static int interactive;		// # stdout 是终端: 每次写都叫醒写线程, 回显不用等时间片结束; 否则靠高水位和时间片结束, 少醒几次
+
+static uint64_t bytes_out, writes, stalls;
+
+static void WriteAll( const struct iovec * iov, int n )
+{
+	struct iovec v[2] = { iov[0], n > 1 ? iov[1] : iov[0] };
+	int i = 0;
+	while( i < n )
+	{
+		ssize_t r = writev( STDOUT_FILENO, v + i, n - i );
+		if( r < 0 )
+		{
+			if( errno == EINTR ) continue;
+			if( errno == EAGAIN )
+			{
+				struct pollfd pfd = { STDOUT_FILENO, POLLOUT, 0 };
+				poll( &pfd, 1, -1 );
+				continue;
+			}
+			return;	// # stdout 关了, 和以前一样丢掉
+		}
+		writes++;
+		while( i < n && (size_t)r >= v[i].iov_len ) r -= v[i++].iov_len;
+		if( i < n )
+		{
+			v[i].iov_base = (uint8_t *)v[i].iov_base + r;
+			v[i].iov_len -= r;
+		}
+	}
+}
+
+// # 把 tail 到 head 之间的字节写出去, 返回写了多少
+static uint32_t Drain( void )
+{
+	uint32_t h = atomic_load_explicit( &head, memory_order_acquire );
+	uint32_t t = atomic_load_explicit( &tail, memory_order_relaxed );
+	if( h == t ) return 0;
+	uint32_t at = t & ( CONSOLE_RING - 1 ), len = h - t;
+	struct iovec iov[2] = { { ring + at, len }, { ring, 0 } };
+	int n = 1;
+	if( at + len > CONSOLE_RING )
+	{
+		iov[0].iov_len = CONSOLE_RING - at;
+		iov[1].iov_len = len - iov[0].iov_len;
+		n = 2;
+	}
+	WriteAll( iov, n );
+	bytes_out += len;
+	atomic_store_explicit( &tail, h, memory_order_release );
+	atomic_thread_fence( memory_order_seq_cst );	// # 和生产者 "先声明要等再看 tail" 配对, 见 ConsoleWrite
+	if( atomic_exchange( &producer_waiting, 0 ) ) sem_post( &space_sem );
+	return len;
+}
+
+static void * WriterMain( void * arg )
+{
+	for( ;; )
+	{
+		while( Drain() );
+		atomic_store( &writer_idle, 1 );
+		// # 先声明要睡了再看一次, 生产者在这之间放进来的字节不会漏掉
+		if( atomic_load( &head ) == atomic_load( &tail ) )
+		{
+			if( atomic_load( &stopping ) ) return 0;
+			sem_wait( &data_sem );
+		}
+		atomic_store( &writer_idle, 0 );
+	}
+}
+
+static void Kick( void )
+{
+	kicked = atomic_load_explicit( &head, memory_order_relaxed );
+	atomic_thread_fence( memory_order_seq_cst );	// # 和写线程 "先声明要睡再看 head" 配对
+	if( atomic_exchange( &writer_idle, 0 ) ) sem_post( &data_sem );
+}
+
+void ConsoleWrite( const void * buf, uint32_t len )
+{
+	const uint8_t * p = (const uint8_t *)buf;
+	if( !running )
+	{
+		// # 没有写线程 (还没起来, 起不来, 或者已经退出) 时同步写
+		struct iovec iov = { (void *)p, len };
+		WriteAll( &iov, 1 );
+		return;
+	}
+	uint32_t h = atomic_load_explicit( &head, memory_order_relaxed );
+	for( uint32_t i = 0; i < len; i++ )
+	{
+		while( h - atomic_load_explicit( &tail, memory_order_acquire ) == CONSOLE_RING )
+		{
+			// # 满了: 把已经放进去的交出去, 等写线程腾地方
+			atomic_store_explicit( &head, h, memory_order_release );
+			stalls++;
+			atomic_store( &producer_waiting, 1 );
+			Kick();
+			if( h - atomic_load( &tail ) == CONSOLE_RING )
+				sem_wait( &space_sem );
+		}
+		ring[h & ( CONSOLE_RING - 1 )] = p[i];
+		h++;
+	}
+	atomic_store_explicit( &head, h, memory_order_release );
+	if( interactive || h - kicked >= CONSOLE_HIGH ) Kick();
+}
+
+void ConsolePut( uint8_t c )
+{
+	ConsoleWrite( &c, 1 );
+}
+
+void ConsoleFlush( void )
+{
+	if( running && atomic_load_explicit( &head, memory_order_relaxed ) != kicked ) Kick();
+}
+
+static void ConsoleClose( void )
+{
+	if( !running ) return;
+	atomic_store( &stopping, 1 );
+	Kick();
+	pthread_join( writer, 0 );
+	running = 0;
+}
+
+static ssize_t CookieWrite( void * c, const char * buf, size_t len )
+{
+	ConsoleWrite( buf, len );
+	return len;
+}
+
+void ConsoleInit( void )
+{
+	if( sem_init( &data_sem, 0, 0 ) || sem_init( &space_sem, 0, 0 ) ) return;
+	cookie_io_functions_t io = { 0, CookieWrite, 0, 0 };
+	FILE * f = fopencookie( 0, "w", io );
+	if( !f ) return;
+	// # 写线程屏蔽所有信号, Ctrl-C 总是落在模拟线程上 (要打断它在空闲时的 ppoll)
+	sigset_t all, old;
+	sigfillset( &all );
+	pthread_sigmask( SIG_SETMASK, &all, &old );
+	int err = pthread_create( &writer, 0, WriterMain, 0 );
+	pthread_sigmask( SIG_SETMASK, &old, 0 );
+	if( err )
+	{
+		fclose( f );
+		return;
+	}
+	fflush( stdout );
+	setvbuf( f, 0, _IONBF, 0 );	// # 不再另外缓冲, printf 的内容马上按顺序进环形缓冲区
+	stdout = f;
+	interactive = isatty( STDOUT_FILENO );
+	running = 1;
+	atexit( ConsoleClose );
+}
+
+void ConsoleReport( void )
+{
+	if( !bytes_out ) return;
+	fprintf( stderr, "console: %llu bytes in %llu writes, guest waited for space %llu times\n",
+		(unsigned long long)bytes_out, (unsigned long long)writes, (unsigned long long)stalls );
+}
@@ -0,0 +1,35 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <stdint.h>
+
+// # 控制台输出: guest 写 UART (以及调试用的 CSR) 的字节先放进一个单生产者单消费者的无锁环形缓冲区,
+// # 由单独的写线程攒成大块 write 出去, 不再一个字符一次系统调用.
+// # stdout 是终端时每次写都叫醒写线程 (它正忙着就不用叫, 写完会接着写), 否则在缓冲区过了高水位, guest 空闲,
+// # 每个时间片结束, 退出时才叫醒; 缓冲区满时 guest 等它腾出地方, 不丢字节.
+// # stdout 也换成了经过同一个缓冲区的无缓冲流, shell 和 core 自己 printf 的东西 (POWEROFF, FAULT, 寄存器转储)
+// # 和 guest 的输出保持先后顺序.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// # 起写线程并接管 stdout; 退出时 (atexit) 自动写完并收掉线程. 失败时保持原来的同步输出
+	void ConsoleInit( void );
+	// # guest 输出一个字节 / 一段字节
+	void ConsolePut( uint8_t c );
+	void ConsoleWrite( const void * buf, uint32_t len );
+	// # 有没写出去的字节就叫醒写线程, 不等它写完 (空闲, 时间片结束时调用)
+	void ConsoleFlush( void );
+	// # 写出的字节数, write 次数, 生产者等待次数, 打到 stderr
+	void ConsoleReport( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CONSOLE_H
@@ -0,0 +1,139 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#include "hostclock.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HOSTCLOCK_HAVE_TSC
+#endif
+
+#define TSC_CALIBRATE_NS	20000000	// # 校准时对照的时长; 两头的读数误差在 100ns 以内, 频率误差约 5ppm
+
+static int use_tsc;
+static uint64_t base;		// # HostClockInit 时的读数, 对外的读数都相对它, 乘积不会太大
+static uint64_t last;		// # 上一次的读数, 保证不减
+static uint64_t us_mult;	// # 微秒 = raw * us_mult >> 64
+static uint64_t tick_mult;	// # 同上, 再除以 divisor
+static double freq;			// # 原始读数每秒走多少
+static uint64_t reads;
+
+static uint64_t MonotonicNs( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#ifdef HOSTCLOCK_HAVE_TSC
+static int TscInvariant( void )
+{
+	unsigned a, b, c, d;
+	if( !__get_cpuid( 0x80000007, &a, &b, &c, &d ) ) return 0;
+	return ( d >> 8 ) & 1;
+}
+
+// # 一对同一时刻的 (ns, tsc): 取几次里夹得最紧的一次, 减少被打断的影响
+static void TscPair( uint64_t * ns, uint64_t * tsc )
+{
+	uint64_t best = UINT64_MAX;
+	for( int i = 0; i < 5; i++ )
+	{
+		uint64_t t0 = __rdtsc();
+		uint64_t n = MonotonicNs();
+		uint64_t t1 = __rdtsc();
+		if( t1 - t0 < best )
+		{
+			best = t1 - t0;
+			*ns = n;
+			*tsc = t0 + ( t1 - t0 ) / 2;
+		}
+	}
+}
+
+static double TscCalibrate( void )
+{
+	uint64_t n0, c0, n1, c1;
+	TscPair( &n0, &c0 );
+	struct timespec ts = { 0, TSC_CALIBRATE_NS };
+	nanosleep( &ts, 0 );
+	TscPair( &n1, &c1 );
+	return (double)( c1 - c0 ) * 1e9 / (double)( n1 - n0 );
+}
+#endif
+
+static inline uint64_t RawRead( void )
+{
+#ifdef HOSTCLOCK_HAVE_TSC
+	if( use_tsc ) return __rdtsc();
+#endif
+	return MonotonicNs();
+}
+
+void HostClockInit( int tsc, uint32_t divisor )
+{
+	use_tsc = 0;
+	freq = 1e9;
+#ifdef HOSTCLOCK_HAVE_TSC
+	if( tsc )
+	{
+		if( TscInvariant() )
+		{
+			freq = TscCalibrate();
+			use_tsc = 1;
+		}
+		else
+			fprintf( stderr, "Warning: no invariant TSC, using CLOCK_MONOTONIC.\n" );
+	}
+#else
+	if( tsc ) fprintf( stderr, "Warning: no TSC on this host, using CLOCK_MONOTONIC.\n" );
+#endif
+
+	// # 2^64 * 1e6 / freq, freq 在 MHz 以上时不会溢出
+	unsigned __int128 one_us = (unsigned __int128)( 1e6 / freq * 18446744073709551616.0 );
+	us_mult = (uint64_t)one_us;
+	tick_mult = (uint64_t)( one_us / ( divisor ? divisor : 1 ) );
+	base = RawRead();
+	last = 0;
+}
+
+uint64_t HostClockRead( void )
+{
+	reads++;
+	uint64_t raw = RawRead() - base;
+	// # 不同核上的 TSC 可能差一点点, 换核时不能让 guest 时间倒退 (差成负数时也一样)
+	if( (int64_t)raw < (int64_t)last ) raw = last;
+	last = raw;
+	return raw;
+}
+
+uint64_t HostClockUs( uint64_t raw )
+{
+	return ( (unsigned __int128)raw * us_mult ) >> 64;
+}
+
+uint64_t HostClockTicks( uint64_t raw )
+{
+	return ( (unsigned __int128)raw * tick_mult ) >> 64;
+}
+
+void HostClockReport( void )
+{
+	// # 现场测一下每次读的开销, 不算进 reads (换算只是一次乘法)
+	const int n = 100000;
+	uint64_t saved = reads;
+	uint64_t t0 = MonotonicNs();
+	for( int i = 0; i < n; i++ )
+		HostClockRead();
+	double ns = (double)( MonotonicNs() - t0 ) / n;
+	reads = saved;
+
+	fprintf( stderr, "clock: %s", use_tsc ? "rdtsc" : "CLOCK_MONOTONIC" );
+	if( use_tsc ) fprintf( stderr, " (%.1f MHz)", freq / 1e6 );
+	fprintf( stderr, ", %llu reads, %.1f ns each, %.2f ms total\n", (unsigned long long)reads, ns, reads * ns / 1e6 );
+}
@@ -0,0 +1,33 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef HOSTCLOCK_H
+#define HOSTCLOCK_H
+
+#include <stdint.h>
+
+// # 主机时钟: 非 -l 时 guest 的 mtime 由它推出, 每个时间片读一次, guest 读 mtime 时也读一次.
+// # 默认读 CLOCK_MONOTONIC (vDSO, 不进内核; 不像 gettimeofday 会被 NTP 往回拨或者往前跳).
+// # 要求用 TSC 且 CPU 有不变 TSC (x86) 时直接 rdtsc, 启动时对着 CLOCK_MONOTONIC 校准频率.
+// # 原始读数到微秒 / guest tick 的换算预先算成 64.64 定点乘数, 热路径里没有除法.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// # divisor: 多少微秒算一个 guest tick (-t); tsc 非 0 时尽量用 rdtsc
+	void HostClockInit( int tsc, uint32_t divisor );
+	// # HostClockInit 以来的原始读数, 保证不减; 和哪次运行无关, 可以记进重放日志
+	uint64_t HostClockRead( void );
+	// # 原始读数换成微秒 / guest tick
+	uint64_t HostClockUs( uint64_t raw );
+	uint64_t HostClockTicks( uint64_t raw );
+	// # 时钟源, 读的次数和每次的开销, 打到 stderr
+	void HostClockReport( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //HOSTCLOCK_H
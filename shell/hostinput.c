@@ -0,0 +1,150 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#include "hostinput.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define INPUT_RING	( 1u << 16 )	// # 2 的幂; 粘贴一大段进来也放得下
+
+static uint8_t ring[INPUT_RING];
+static _Atomic uint32_t head;	// # 读线程写到哪里, 只增不减, 用时取模
+static _Atomic uint32_t tail;	// # guest 取到哪里
+static atomic_int eof;			// # stdin 读到头 (或者出错) 了, 在最后一次移动 head 之后才置
+
+static pthread_t reader;
+static int running;
+static sem_t space_sem;			// # 缓冲区满时读线程在这里等
+static atomic_int reader_waiting;
+static int wake_fd = -1;		// # eventfd, 叫醒空闲的模拟线程
+static atomic_int vm_waiting;	// # 模拟线程登记了要等, 读线程放进字节后要写 wake_fd
+static _Atomic uint64_t wakes;	// # 读线程写了几次 wake_fd. 写之前就加: 模拟线程被叫醒时读线程可能还没来得及再跑
+static uint64_t wakes_cleared;	// # 模拟线程从 wake_fd 读走了几次
+
+static _Atomic uint64_t bytes_in, reads;
+
+// # 从 stdin 读一次, 放进 head 之后的空位 (调用方保证有空位). block 为 0 时没数据就直接返回
+static void Fill( int block )
+{
+	if( !block )
+	{
+		struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+		if( poll( &pfd, 1, 0 ) <= 0 ) return;
+	}
+	uint32_t h = atomic_load_explicit( &head, memory_order_relaxed );
+	uint32_t t = atomic_load_explicit( &tail, memory_order_acquire );
+	uint32_t at = h & ( INPUT_RING - 1 );
+	uint32_t room = INPUT_RING - ( h - t );
+	if( room > INPUT_RING - at ) room = INPUT_RING - at;	// # 一次只读到环的末尾
+	ssize_t r = read( STDIN_FILENO, ring + at, room );
+	reads++;
+	if( r > 0 )
+	{
+		bytes_in += r;
+		atomic_store_explicit( &head, h + r, memory_order_release );
+	}
+	else if( r == 0 || ( errno != EINTR && errno != EAGAIN ) )
+		atomic_store( &eof, 1 );	// # 对端关闭, /dev/null, pty 没了 (EIO): 以后不会再有输入
+	else if( errno == EAGAIN && block )
+	{
+		// # stdin 被设成了非阻塞 (和别的进程共用终端时可能发生)
+		struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+		poll( &pfd, 1, -1 );
+	}
+}
+
+static void Notify( void )
+{
+	atomic_thread_fence( memory_order_seq_cst );	// # 和模拟线程 "先登记再看 head" 配对, 见 HostInputWaitFd
+	if( atomic_exchange( &vm_waiting, 0 ) )
+	{
+		uint64_t one = 1;
+		wakes++;
+		if( write( wake_fd, &one, sizeof( one ) ) < 0 ) {}
+	}
+}
+
+static void * ReaderMain( void * arg )
+{
+	while( !atomic_load( &eof ) )
+	{
+		uint32_t h = atomic_load_explicit( &head, memory_order_relaxed );
+		if( h - atomic_load_explicit( &tail, memory_order_acquire ) == INPUT_RING )
+		{
+			atomic_store( &reader_waiting, 1 );
+			if( h - atomic_load( &tail ) == INPUT_RING )
+				sem_wait( &space_sem );
+			continue;
+		}
+		Fill( 1 );
+		Notify();
+	}
+	return 0;
+}
+
+void HostInputInit( void )
+{
+	wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	if( wake_fd < 0 || sem_init( &space_sem, 0, 0 ) ) return;
+	// # 读线程屏蔽所有信号, Ctrl-C 总是落在模拟线程上
+	sigset_t all, old;
+	sigfillset( &all );
+	pthread_sigmask( SIG_SETMASK, &all, &old );
+	running = pthread_create( &reader, 0, ReaderMain, 0 ) == 0;
+	pthread_sigmask( SIG_SETMASK, &old, 0 );
+	if( running ) pthread_detach( reader );	// # 退出时它多半阻塞在 read 里, 不等它
+}
+
+int HostInputReady( void )
+{
+	int e = atomic_load( &eof );
+	uint32_t t = atomic_load_explicit( &tail, memory_order_relaxed );
+	if( atomic_load_explicit( &head, memory_order_acquire ) != t ) return 1;
+	if( e ) return -1;
+	if( running ) return 0;
+	Fill( 0 );	// # 没有读线程: 缓冲区空的时候才去看 stdin
+	if( atomic_load_explicit( &head, memory_order_relaxed ) != t ) return 1;
+	return atomic_load( &eof ) ? -1 : 0;
+}
+
+int HostInputByte( void )
+{
+	if( HostInputReady() <= 0 ) return -1;
+	uint32_t t = atomic_load_explicit( &tail, memory_order_relaxed );
+	int c = ring[t & ( INPUT_RING - 1 )];
+	atomic_store_explicit( &tail, t + 1, memory_order_release );
+	atomic_thread_fence( memory_order_seq_cst );	// # 和读线程 "先声明要等再看 tail" 配对
+	if( atomic_exchange( &reader_waiting, 0 ) ) sem_post( &space_sem );
+	return c;
+}
+
+int HostInputWaitFd( void )
+{
+	if( !running ) return HostInputReady() ? -1 : STDIN_FILENO;
+	if( (int64_t)( atomic_load( &wakes ) - wakes_cleared ) > 0 )
+	{
+		// # 读线程写过 (或者正要写) wake_fd, 清掉, 不然空闲等待会一直被它唤醒.
+		// # 还没写进去时读不到, 下次再清; 读到的是累计次数
+		uint64_t v;
+		if( read( wake_fd, &v, sizeof( v ) ) == sizeof( v ) ) wakes_cleared += v;
+	}
+	atomic_store( &vm_waiting, 1 );
+	// # 先登记再看一次, 读线程在这之间放进来的字节不会漏掉 (它那边是先移动 head 再看登记)
+	return HostInputReady() ? -1 : wake_fd;
+}
+
+void HostInputReport( void )
+{
+	if( !reads ) return;
+	fprintf( stderr, "input: %llu bytes in %llu reads, %llu wakeups\n",
+		(unsigned long long)bytes_in, (unsigned long long)reads, (unsigned long long)wakes );
+}
@@ -0,0 +1,34 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef HOSTINPUT_H
+#define HOSTINPUT_H
+
+#include <stdint.h>
+
+// # 串口输入: 单独的读线程阻塞在 stdin 上, 读到的字节放进单生产者单消费者的无锁环形缓冲区.
+// # 模拟线程问有没有输入, 取字节都只看内存, 没有系统调用.
+// # 模拟线程要空闲等待时先 "登记" 一下, 读线程之后再放进字节 (或者读到 EOF) 就写一次 eventfd 把它叫醒;
+// # 没登记时读线程不碰 eventfd. 缓冲区满了读线程就不再读 stdin, 等 guest 取走.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// # 起读线程; 失败 (或者没调用) 时退回到模拟线程自己非阻塞地读 stdin
+	void HostInputInit( void );
+	// # 1 = 有字节可取, 0 = 没有, -1 = EOF 且已经取完
+	int HostInputReady( void );
+	// # 取一个字节, 没有时返回 -1
+	int HostInputByte( void );
+	// # 准备空闲等待: 返回有输入 (或 EOF) 时会变成可读的 fd; 已经有输入或者 EOF 时返回 -1, 不用等
+	int HostInputWaitFd( void );
+	// # 读到的字节数, read 次数, 唤醒次数, 打到 stderr
+	void HostInputReport( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //HOSTINPUT_H
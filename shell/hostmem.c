@@ -0,0 +1,152 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#include "hostmem.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static const char * ram_kind = "malloc";	// # 实际用上的映射方式, 报告里用
+static int ram_mapped;	// # RAM 是自己 mmap 的 (不是 malloc 退路), 可以 madvise / 覆盖映射
+static long file_len;	// # RAM 开头映射着镜像文件的长度, 0 = 没有
+
+static size_t HugeRoundUp( size_t len )
+{
+	return ( len + HOSTMEM_HUGE_PAGE - 1 ) & ~(size_t)( HOSTMEM_HUGE_PAGE - 1 );
+}
+
+uint8_t * HostRamAlloc( uint32_t size, int hugetlb )
+{
+	size_t len = HugeRoundUp( size );
+
+#ifdef MAP_HUGETLB
+	if( hugetlb )
+	{
+		// # 显式大页的映射天然按大页对齐
+		void * p = mmap( 0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+		if( p != MAP_FAILED )
+		{
+			ram_kind = "hugetlb";
+			ram_mapped = 1;
+			return (uint8_t *)p;
+		}
+		fprintf( stderr, "Warning: MAP_HUGETLB failed (no reserved huge pages?), falling back to THP.\n" );
+	}
+#endif
+
+	// # 多映射 2MiB, 取其中对齐的一段, 两头多出来的还给系统
+	uint8_t * raw = (uint8_t *)mmap( 0, len + HOSTMEM_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if( raw == MAP_FAILED ) return 0;
+	uint8_t * p = (uint8_t *)HugeRoundUp( (uintptr_t)raw );
+	if( p > raw ) munmap( raw, p - raw );
+	if( raw + HOSTMEM_HUGE_PAGE > p ) munmap( p + len, raw + HOSTMEM_HUGE_PAGE - p );
+
+	ram_kind = "4k";
+	ram_mapped = 1;
+#ifdef MADV_HUGEPAGE
+	if( madvise( p, len, MADV_HUGEPAGE ) == 0 ) ram_kind = "thp";
+#endif
+	return p;
+}
+
+int HostRamMapAt( uint8_t * at, uint32_t size, int hugetlb )
+{
+	// # 这里不能向上取整: guard 模式靠 RAM 之后紧接着的不可访问页来发现越界
+#ifdef MAP_HUGETLB
+	if( hugetlb && size % HOSTMEM_HUGE_PAGE == 0 && (uintptr_t)at % HOSTMEM_HUGE_PAGE == 0 )
+	{
+		if( mmap( at, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0 ) != MAP_FAILED )
+		{
+			ram_kind = "hugetlb";
+			ram_mapped = 1;
+			return 0;
+		}
+		// # 失败的 MAP_FIXED 可能已经拆掉了原来的保留, 重新补上, 不能让别的分配落进保留区
+		mmap( at, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0 );
+		fprintf( stderr, "Warning: MAP_HUGETLB failed (no reserved huge pages?), falling back to THP.\n" );
+	}
+#endif
+
+	if( mprotect( at, size, PROT_READ | PROT_WRITE ) ) return -1;
+	ram_kind = "4k";
+	ram_mapped = 1;
+#ifdef MADV_HUGEPAGE
+	if( madvise( at, size, MADV_HUGEPAGE ) == 0 ) ram_kind = "thp";
+#endif
+	return 0;
+}
+
+void HostRamClear( uint8_t * ram, uint32_t size )
+{
+	if( ram_mapped )
+	{
+		// # 先把镜像的文件映射换回匿名内存, 否则 DONTNEED 之后读到的是文件内容而不是零
+		if( file_len )
+		{
+			if( mmap( ram, file_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0 ) == MAP_FAILED )
+			{
+				perror( "mmap" );
+				exit( -8 );
+			}
+#ifdef MADV_HUGEPAGE
+			madvise( ram, file_len, MADV_HUGEPAGE );
+#endif
+			file_len = 0;
+		}
+		// # 私有匿名映射 DONTNEED 之后页被丢掉, 再访问时按需填零页
+		if( madvise( ram, size, MADV_DONTNEED ) == 0 ) return;
+	}
+	memset( ram, 0, size );
+}
+
+int HostRamLoadFile( uint8_t * ram, int fd, long flen )
+{
+	// # hugetlb 映射不能按 4KiB 拆开, 交给 fread
+	if( !ram_mapped || strcmp( ram_kind, "hugetlb" ) == 0 || flen <= 0 ) return -1;
+	if( mmap( ram, flen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0 ) == MAP_FAILED ) return -1;
+	file_len = flen;
+	return 0;
+}
+
+int HostRamRevert( uint8_t * ram, uint32_t size )
+{
+	if( !ram_mapped || !file_len ) return -1;
+	return madvise( ram, size, MADV_DONTNEED );
+}
+
+void HostRamReport( const uint8_t * p, uint32_t size )
+{
+	FILE * f = fopen( "/proc/self/smaps", "r" );
+	if( !f ) return;
+
+	// # 累加和 [p, p + size) 相交的所有 VMA (madvise 可能把一段映射拆成几个)
+	uintptr_t lo = (uintptr_t)p, hi = lo + size;
+	unsigned long long rss_kb = 0, huge_kb = 0, kb;
+	int in_range = 0;
+	char line[256];
+	while( fgets( line, sizeof( line ), f ) )
+	{
+		unsigned long start, end;
+		if( sscanf( line, "%lx-%lx ", &start, &end ) == 2 )
+			in_range = start < hi && end > lo;
+		else if( !in_range )
+			continue;
+		else if( sscanf( line, "Rss: %llu kB", &kb ) == 1 )
+			rss_kb += kb;
+		else if( sscanf( line, "AnonHugePages: %llu kB", &kb ) == 1 )
+			huge_kb += kb;
+		else if( sscanf( line, "Private_Hugetlb: %llu kB", &kb ) == 1 || sscanf( line, "Shared_Hugetlb: %llu kB", &kb ) == 1 )
+		{
+			// # hugetlb 页不计入 Rss
+			rss_kb += kb;
+			huge_kb += kb;
+		}
+	}
+	fclose( f );
+
+	fprintf( stderr, "RAM: %u MiB (%s), %llu MiB resident, %llu MiB on huge pages (%llu%%)\n",
+		size >> 20, ram_kind, rss_kb >> 10, huge_kb >> 10, rss_kb ? huge_kb * 100 / rss_kb : 0 );
+}
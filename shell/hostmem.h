@@ -0,0 +1,39 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef HOSTMEM_H
+#define HOSTMEM_H
+
+#include <stdint.h>
+
+// # guest RAM 的主机内存: 按 2MiB 对齐 mmap 并 MADV_HUGEPAGE, 让大块 RAM 尽量落在透明大页上, 减少 dTLB miss.
+// # hugetlb 非 0 时先试显式大页 (MAP_HUGETLB, 需要预留 /proc/sys/vm/nr_hugepages), 失败再退回普通映射.
+
+#define HOSTMEM_HUGE_PAGE	( 2u * 1024 * 1024 )
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// # 分配 size 字节 RAM, 起点 2MiB 对齐; 失败返回 0
+	uint8_t * HostRamAlloc( uint32_t size, int hugetlb );
+	// # 在已经保留好的地址 at 上 (guard 模式的保留区) 映射可读写的 RAM, 成功返回 0
+	int HostRamMapAt( uint8_t * at, uint32_t size, int hugetlb );
+	// # 把 RAM 清零. mmap 得来的 RAM 用 MADV_DONTNEED 丢掉所有页, 之后按需再填零页, 不用逐字节写
+	void HostRamClear( uint8_t * ram, uint32_t size );
+	// # 把镜像文件 MAP_PRIVATE 映射到 RAM 起点: 用到哪页才读哪页, 同一个镜像的多个实例共享页缓存,
+	// # guest 写入时才复制. 成功返回 0; RAM 不是 mmap 得来的或映射失败返回 -1, 调用者改用 fread
+	int HostRamLoadFile( uint8_t * ram, int fd, long flen );
+	// # 把 RAM 退回到刚装载完镜像时的样子: DONTNEED 丢掉 guest 碰过的页, 镜像部分回到文件内容 (写时复制的快照),
+	// # 其余回到零页; 代价只和被弄脏的页数有关. 之后装载器另外写进去的东西 (DTB) 要调用者自己恢复.
+	// # 镜像不是映射进来的 (fread 退路) 时返回 -1
+	int HostRamRevert( uint8_t * ram, uint32_t size );
+	// # 按 /proc/self/smaps 统计 [p, p + size) 已驻留的部分有多少落在大页上, 打到 stderr
+	void HostRamReport( const uint8_t * p, uint32_t size );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //HOSTMEM_H
@@ -0,0 +1,78 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#include "mmio.h"
+
+#include <stdio.h>
+
+#define MMIO_PAGES	( ( MMIO_END - MMIO_BASE ) >> MMIO_PAGE_SHIFT )
+
+struct MmioDevice
+{
+	const char * name;
+	uint32_t base, size;
+	MmioLoadFn load;
+	MmioStoreFn store;
+	void * ctx;
+	uint64_t loads, stores;
+};
+
+static uint32_t NoLoad( void * ctx, uint32_t ofs ) { return 0; }
+static uint32_t NoStore( void * ctx, uint32_t ofs, uint32_t val ) { return 0; }
+
+// # 0 号是 "未映射": 覆盖整个窗口, 回调什么都不做, 查表不用判空
+static struct MmioDevice devices[MMIO_DEVICES] = { { "unmapped", MMIO_BASE, MMIO_END - MMIO_BASE, NoLoad, NoStore } };
+static int device_count = 1;
+static uint8_t page_device[MMIO_PAGES];	// # 每页归哪个设备, 24KiB
+
+int MmioRegister( const char * name, uint32_t base, uint32_t size, MmioLoadFn load, MmioStoreFn store, void * ctx )
+{
+	if( device_count == MMIO_DEVICES || !size || base < MMIO_BASE || base > MMIO_END || MMIO_END - base < size )
+		return -1;
+	uint32_t first = ( base - MMIO_BASE ) >> MMIO_PAGE_SHIFT;
+	uint32_t last = ( base - MMIO_BASE + size - 1 ) >> MMIO_PAGE_SHIFT;
+	for( uint32_t p = first; p <= last; p++ )
+		if( page_device[p] ) return -1;
+	struct MmioDevice * d = &devices[device_count];
+	d->name = name;
+	d->base = base;
+	d->size = size;
+	d->load = load ? load : NoLoad;
+	d->store = store ? store : NoStore;
+	d->ctx = ctx;
+	for( uint32_t p = first; p <= last; p++ )
+		page_device[p] = device_count;
+	device_count++;
+	return 0;
+}
+
+// # 调用方 (MINIRV32_MMIO_RANGE) 已经保证 addy 在窗口里. 设备不满一页时页内其余地址按未映射处理
+uint32_t MmioLoad( uint32_t addy )
+{
+	struct MmioDevice * d = &devices[page_device[( addy - MMIO_BASE ) >> MMIO_PAGE_SHIFT]];
+	uint32_t ofs = addy - d->base;
+	if( ofs >= d->size ) d = devices, ofs = addy - MMIO_BASE;
+	d->loads++;
+	return d->load( d->ctx, ofs );
+}
+
+uint32_t MmioStore( uint32_t addy, uint32_t val )
+{
+	struct MmioDevice * d = &devices[page_device[( addy - MMIO_BASE ) >> MMIO_PAGE_SHIFT]];
+	uint32_t ofs = addy - d->base;
+	if( ofs >= d->size ) d = devices, ofs = addy - MMIO_BASE;
+	d->stores++;
+	return d->store( d->ctx, ofs, val );
+}
+
+void MmioReport( void )
+{
+	for( int i = 0; i < device_count; i++ )
+	{
+		struct MmioDevice * d = &devices[i];
+		if( !d->loads && !d->stores ) continue;
+		fprintf( stderr, "mmio: %-10s %08x-%08x, %llu loads, %llu stores\n", d->name, d->base, d->base + d->size - 1,
+			(unsigned long long)d->loads, (unsigned long long)d->stores );
+	}
+}
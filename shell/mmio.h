@@ -0,0 +1,40 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef MMIO_H
+#define MMIO_H
+
+#include <stdint.h>
+
+// # MMIO 设备表: 设备登记自己的地址范围, 读写回调和上下文, shell 的 HandleControlLoad / Store 查表分发.
+// # 窗口 [MMIO_BASE, MMIO_END) 和 hook.h 的 MINIRV32_MMIO_RANGE 一致, 按 4KiB 页建一张索引表,
+// # 一次访问就是一次查表加一次间接调用, 设备再多也一样. 两个设备不能共用一页.
+// # 窗口内没有设备的地址读为 0, 写被忽略 (以前的行为), 也单独计数.
+
+#define MMIO_BASE		0x0c000000
+#define MMIO_END		0x12000000
+#define MMIO_PAGE_SHIFT	12
+#define MMIO_DEVICES	16			// # 含 0 号 "未映射"
+
+// # ofs 相对设备的 base, 保证 < size
+typedef uint32_t (*MmioLoadFn)( void * ctx, uint32_t ofs );
+// # 返回非 0 时 step 立即以这个值返回 (syscon 的关机 / 重启)
+typedef uint32_t (*MmioStoreFn)( void * ctx, uint32_t ofs, uint32_t val );
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// # 登记设备, load / store 可以为 0 (读为 0 / 写忽略). 范围越出窗口或者和已有设备落在同一页时返回 -1
+	int MmioRegister( const char * name, uint32_t base, uint32_t size, MmioLoadFn load, MmioStoreFn store, void * ctx );
+	uint32_t MmioLoad( uint32_t addy );
+	uint32_t MmioStore( uint32_t addy, uint32_t val );
+	// # 各设备的读写次数, -v 时打印
+	void MmioReport( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //MMIO_H
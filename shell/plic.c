@@ -0,0 +1,99 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#include "plic.h"
+
+#include <string.h>
+
+// # 源不超过 32 个, 挂起, 使能, 电平, 在服务中各用一个 32 位图
+static uint32_t priority[PLIC_SOURCES];
+static uint32_t pending;
+static uint32_t enable;
+static uint32_t level;
+static uint32_t claimed;	// # 已经 claim 还没有 complete
+static uint32_t threshold;
+
+void PlicReset( void )
+{
+	memset( priority, 0, sizeof( priority ) );
+	pending = enable = level = claimed = threshold = 0;
+}
+
+void PlicSetLevel( int source, int high )
+{
+	uint32_t bit = 1u << source;
+	if( high )
+	{
+		level |= bit;
+		if( !( claimed & bit ) ) pending |= bit;
+	}
+	else
+	{
+		// # 电平触发: 线放下了就不再挂起 (还没被 claim 的话)
+		level &= ~bit;
+		pending &= ~bit;
+	}
+}
+
+// # 能送出的源里优先级最高的, 同级取编号小的; 没有时为 0
+static int Best( void )
+{
+	uint32_t ready = pending & enable & ~1u;
+	int best = 0;
+	uint32_t best_prio = threshold;
+	while( ready )
+	{
+		int n = __builtin_ctz( ready );
+		ready &= ready - 1;
+		if( priority[n] > best_prio )
+		{
+			best = n;
+			best_prio = priority[n];
+		}
+	}
+	return best;
+}
+
+int PlicPending( void )
+{
+	return Best() != 0;
+}
+
+uint32_t PlicLoad( uint32_t ofs )
+{
+	if( ofs < 4 * PLIC_SOURCES ) return priority[ofs / 4];
+	if( ofs == 0x1000 ) return pending;
+	if( ofs == 0x2000 ) return enable;
+	if( ofs == 0x200000 ) return threshold;
+	if( ofs == 0x200004 )
+	{
+		int n = Best();
+		if( n )
+		{
+			pending &= ~( 1u << n );
+			claimed |= 1u << n;
+		}
+		return n;
+	}
+	return 0;
+}
+
+void PlicStore( uint32_t ofs, uint32_t val )
+{
+	if( ofs < 4 * PLIC_SOURCES )
+	{
+		if( ofs >= 4 ) priority[ofs / 4] = val & 7;
+	}
+	else if( ofs == 0x2000 )
+		enable = val & ~1u;
+	else if( ofs == 0x200000 )
+		threshold = val & 7;
+	else if( ofs == 0x200004 && val < PLIC_SOURCES )
+	{
+		uint32_t bit = 1u << val;
+		if( !( claimed & bit ) ) return;
+		claimed &= ~bit;
+		if( level & bit ) pending |= bit;
+	}
+}
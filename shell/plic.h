@@ -0,0 +1,41 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef PLIC_H
+#define PLIC_H
+
+#include <stdint.h>
+
+// # 平台级中断控制器 (SiFive PLIC 的寄存器布局), 只有一个上下文: hart 0 的 M 态, 输出接 mip.MEIP.
+// # 中断源按电平触发: 设备拉高自己的线就挂起, 被 claim 之后到 complete 之前不再挂起, complete 时线还高就再挂起.
+// # 寄存器 (相对 PLIC_BASE): 0x0 + 4*n 优先级, 0x1000 挂起位, 0x2000 使能位, 0x200000 阈值, 0x200004 claim / complete.
+
+#define PLIC_BASE		0x0c000000
+#define PLIC_SIZE		0x04000000
+#define PLIC_SOURCES	32			// # 源 0 保留不用, DTB 里 riscv,ndev = 31
+
+// # 各设备的中断号, 和 DTB 一致
+#define PLIC_IRQ_BLK	1			// # virtio 设备从 1 起, 每个设备一个
+#define PLIC_IRQ_NET	2
+#define PLIC_IRQ_UART	10
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// # 上电状态: 优先级, 使能, 阈值全 0, 没有挂起
+	void PlicReset( void );
+	// # 设备中断线的电平
+	void PlicSetLevel( int source, int level );
+	// # 有没有使能的, 优先级高于阈值的挂起源 (即 MEIP)
+	int PlicPending( void );
+	// # guest 读写, ofs 相对 PLIC_BASE
+	uint32_t PlicLoad( uint32_t ofs );
+	void PlicStore( uint32_t ofs, uint32_t val );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //PLIC_H
@@ -0,0 +1,156 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#include "replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// # 日志格式: 8 字节魔数, 头部三个 varint, 然后每条两个 varint: 指令计数的差 (zigzag) 左移 3 位或上种类, 和值.
+// # 时钟读数单调不减, 记和上一次读数的差; 其余的值记 zigzag. 同一片里的条目只占两三个字节
+
+#define REPLAY_MAGIC	"MRV32RR\1"
+
+static const char * event_names[REPLAY_EVENTS] = { "clock", "kbhit", "kbbyte", "idle", "restart" };
+
+static FILE * log_file;
+static int playing;
+static uint64_t last_stamp;
+static uint64_t last_clock;
+static uint64_t entries;
+static long log_bytes;	// # 关闭时的日志长度, 给退出时的报告用
+
+static void PutVarint( uint64_t v )
+{
+	while( v >= 0x80 )
+	{
+		putc( (int)( v & 0x7f ) | 0x80, log_file );
+		v >>= 7;
+	}
+	putc( (int)v, log_file );
+}
+
+static int GetVarint( uint64_t * v )
+{
+	*v = 0;
+	for( int shift = 0; shift < 64; shift += 7 )
+	{
+		int c = getc( log_file );
+		if( c == EOF ) return -1;
+		*v |= (uint64_t)( c & 0x7f ) << shift;
+		if( !( c & 0x80 ) ) return 0;
+	}
+	return -1;
+}
+
+static uint64_t ZigZag( int64_t v ) { return ( (uint64_t)v << 1 ) ^ (uint64_t)( v >> 63 ); }
+static int64_t UnZigZag( uint64_t v ) { return (int64_t)( v >> 1 ) ^ -(int64_t)( v & 1 ); }
+
+int ReplayOpen( const char * path, int play, const struct ReplayHeader * hdr )
+{
+	log_file = fopen( path, play ? "rb" : "wb" );
+	if( !log_file )
+	{
+		fprintf( stderr, "Error: could not open replay log \"%s\"\n", path );
+		return -1;
+	}
+	setvbuf( log_file, 0, _IOFBF, 1 << 16 );
+	playing = play;
+
+	if( !play )
+	{
+		fwrite( REPLAY_MAGIC, 8, 1, log_file );
+		PutVarint( hdr->ram_amt );
+		PutVarint( hdr->time_divisor );
+		PutVarint( hdr->flags );
+		return 0;
+	}
+
+	char magic[8];
+	uint64_t ram, div, flags;
+	if( fread( magic, 8, 1, log_file ) != 1 || memcmp( magic, REPLAY_MAGIC, 8 ) ||
+		GetVarint( &ram ) || GetVarint( &div ) || GetVarint( &flags ) )
+	{
+		fprintf( stderr, "Error: \"%s\" is not a replay log\n", path );
+		return -1;
+	}
+	if( ram != hdr->ram_amt || div != hdr->time_divisor || flags != hdr->flags )
+	{
+		fprintf( stderr, "Error: replay log was recorded with different options (ram %llu, time divisor %llu, flags %llx)\n",
+			(unsigned long long)ram, (unsigned long long)div, (unsigned long long)flags );
+		return -1;
+	}
+	return 0;
+}
+
+int ReplayPlaying( void )
+{
+	return playing;
+}
+
+int64_t ReplayInput( enum ReplayEvent ev, uint64_t stamp, int64_t value )
+{
+	if( !log_file ) return value;
+	entries++;
+
+	if( !playing )
+	{
+		PutVarint( ZigZag( (int64_t)( stamp - last_stamp ) ) << 3 | ev );
+		if( ev == REPLAY_CLOCK )
+		{
+			PutVarint( (uint64_t)value - last_clock );
+			last_clock = value;
+		}
+		else
+			PutVarint( ZigZag( value ) );
+		last_stamp = stamp;
+		return value;
+	}
+
+	uint64_t head, v;
+	if( GetVarint( &head ) )
+	{
+		fprintf( stderr, "replay: end of log at instruction %llu\n", (unsigned long long)stamp );
+		exit( 0 );
+	}
+	unsigned got = head & 7;
+	uint64_t dstamp = head >> 3;
+	if( got >= REPLAY_EVENTS || GetVarint( &v ) )
+	{
+		fprintf( stderr, "replay: corrupt log at entry %llu\n", (unsigned long long)entries );
+		exit( 1 );
+	}
+	uint64_t want = last_stamp + UnZigZag( dstamp );
+	if( got != ev || want != stamp )
+	{
+		fprintf( stderr, "replay: diverged at entry %llu: log has %s at instruction %llu, execution asked for %s at %llu\n",
+			(unsigned long long)entries, event_names[got], (unsigned long long)want, event_names[ev], (unsigned long long)stamp );
+		exit( 1 );
+	}
+	last_stamp = stamp;
+	if( ev == REPLAY_CLOCK )
+		return last_clock += v;
+	return UnZigZag( v );
+}
+
+void ReplayFlush( void )
+{
+	if( log_file && !playing ) fflush( log_file );
+}
+
+void ReplayClose( void )
+{
+	if( !log_file ) return;
+	log_bytes = ftell( log_file );
+	fclose( log_file );
+	log_file = 0;
+}
+
+void ReplayReport( void )
+{
+	if( !entries ) return;
+	fprintf( stderr, "replay: %llu entries %s, %ld bytes\n", (unsigned long long)entries,
+		playing ? "replayed" : "recorded", log_file ? ftell( log_file ) : log_bytes );
+}
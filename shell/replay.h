@@ -0,0 +1,54 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+
+// # 录制 / 重放: guest 看得到的不确定输入 (主机时钟读数, stdin 有没有数据, 读到的字节, 空闲等待时哪些 fd 醒了, 重启)
+// # 按发生顺序记进一个紧凑的二进制日志, 每条带上当时的指令计数 (所在时间片开头的 cycle).
+// # 时间片长短, 忙等检测, 中断时机等等都由这些输入决定, 重放时原样喂回去, 执行就完全相同, 而且不再真的等待.
+// # 重放时条目的种类或指令计数对不上就报告分叉并退出: 换个引擎或者优化重放同一份日志, 就能确认执行没有变.
+
+enum ReplayEvent
+{
+	REPLAY_CLOCK,	// # HostClockRead 的读数
+	REPLAY_KBHIT,	// # IsKBHit 的结果
+	REPLAY_KBBYTE,	// # ReadKBByte 的结果
+	REPLAY_IDLE,	// # SchedIdle 醒来时就绪的事件 (位图)
+	REPLAY_RESTART,	// # syscon 重启, 只是个记号
+	REPLAY_EVENTS
+};
+
+// # 日志头: 影响执行的选项, 重放时必须和录制时一样
+struct ReplayHeader
+{
+	uint32_t ram_amt;
+	uint32_t time_divisor;
+	uint32_t flags;	// # shell 自己定义的选项位
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// # play 为 0 时录制到 path, 否则从 path 重放; 失败时打印原因, 返回 -1
+	int ReplayOpen( const char * path, int play, const struct ReplayHeader * hdr );
+	int ReplayPlaying( void );
+	// # 一个不确定输入: 重放时返回日志里的值 (value 不用); 否则原样返回 value, 录制时顺便记下.
+	// # 日志读完时打印指令计数并正常退出, 分叉时报告并以 1 退出
+	int64_t ReplayInput( enum ReplayEvent ev, uint64_t stamp, int64_t value );
+	// # 把缓冲的条目写出去. 空闲等待前调用, 录制中的进程被杀掉时日志至少完整到最后一次等待
+	void ReplayFlush( void );
+	// # 写完缓冲区, 关掉日志
+	void ReplayClose( void );
+	// # 条目数和日志大小, 打到 stderr
+	void ReplayReport( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //REPLAY_H
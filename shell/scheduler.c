@@ -0,0 +1,195 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#define _GNU_SOURCE	// # ppoll
+#include "scheduler.h"
+
+#include <poll.h>
+#include <time.h>
+#include <sys/prctl.h>
+
+static struct
+{
+	uint64_t when;
+	SchedFn fn;
+	int slot;	// # 在堆里的下标 + 1, 0 = 不在队列中
+	int watched;	// # 关联了 fd
+	int fd;
+	short poll;		// # 等 fd 的什么: POLLIN / POLLOUT
+} events[SCHED_EVENTS];
+
+static int heap[SCHED_EVENTS];	// # 事件号, heap[0] 的截止时间最早
+static int heap_n;
+
+static void HeapSwap( int a, int b )
+{
+	int t = heap[a];
+	heap[a] = heap[b];
+	heap[b] = t;
+	events[heap[a]].slot = a + 1;
+	events[heap[b]].slot = b + 1;
+}
+
+static void HeapUp( int i )
+{
+	while( i > 0 && events[heap[( i - 1 ) / 2]].when > events[heap[i]].when )
+	{
+		HeapSwap( i, ( i - 1 ) / 2 );
+		i = ( i - 1 ) / 2;
+	}
+}
+
+static void HeapDown( int i )
+{
+	for( ;; )
+	{
+		int m = i, l = 2 * i + 1, r = 2 * i + 2;
+		if( l < heap_n && events[heap[l]].when < events[heap[m]].when ) m = l;
+		if( r < heap_n && events[heap[r]].when < events[heap[m]].when ) m = r;
+		if( m == i ) return;
+		HeapSwap( i, m );
+		i = m;
+	}
+}
+
+static void HeapRemove( int i )
+{
+	events[heap[i]].slot = 0;
+	if( --heap_n == i ) return;
+	heap[i] = heap[heap_n];
+	events[heap[i]].slot = i + 1;
+	HeapDown( i );
+	HeapUp( i );
+}
+
+void SchedSet( enum SchedEvent ev, uint64_t when, SchedFn fn )
+{
+	events[ev].fn = fn;
+	events[ev].when = when;
+	int i = events[ev].slot - 1;
+	if( when == SCHED_NEVER )
+	{
+		if( i >= 0 ) HeapRemove( i );
+		return;
+	}
+	if( i < 0 )
+	{
+		i = heap_n++;
+		heap[i] = ev;
+		events[ev].slot = i + 1;
+	}
+	HeapDown( i );
+	HeapUp( i );
+}
+
+void SchedReset()
+{
+	while( heap_n ) HeapRemove( 0 );
+}
+
+uint64_t SchedNext()
+{
+	return heap_n ? events[heap[0]].when : SCHED_NEVER;
+}
+
+void SchedRun( uint64_t now )
+{
+	while( heap_n && events[heap[0]].when <= now )
+	{
+		int ev = heap[0];
+		HeapRemove( 0 );
+		events[ev].when = SCHED_NEVER;
+		if( events[ev].fn ) events[ev].fn( now );
+	}
+}
+
+void SchedWatchFd( enum SchedEvent ev, int fd )
+{
+	events[ev].watched = fd >= 0;
+	events[ev].fd = fd;
+	events[ev].poll = POLLIN;
+}
+
+void SchedWatchFdWritable( enum SchedEvent ev, int fd )
+{
+	SchedWatchFd( ev, fd );
+	events[ev].poll = POLLOUT;
+}
+
+uint64_t SchedNextTimed()
+{
+	// # 事件只有几个, 直接扫一遍
+	uint64_t next = SCHED_NEVER;
+	for( int i = 0; i < heap_n; i++ )
+		if( !events[heap[i]].watched && events[heap[i]].when < next )
+			next = events[heap[i]].when;
+	return next;
+}
+
+static uint64_t MonotonicNs()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// # ppoll 超时后实际多睡的时间 (虚拟机里常有一两百微秒), 指数平均.
+// # 每次提前这么多醒来, 剩下一点由主循环空转过去, 中断才能按时送到
+static uint64_t idle_late_ns;
+
+void SchedWake( unsigned mask )
+{
+	for( int ev = 0; ev < SCHED_EVENTS; ev++ )
+		if( mask & ( 1u << ev ) )
+			SchedSet( ev, 0, events[ev].fn );
+}
+
+unsigned SchedIdle( uint64_t timeout_us, const sigset_t * sigmask )
+{
+	uint64_t want_ns = timeout_us == SCHED_NEVER ? 0 : timeout_us * 1000;
+	if( timeout_us != SCHED_NEVER && want_ns <= idle_late_ns )
+	{
+		// # 不睡就量不到新的迟到时间: 和别的进程抢一个 CPU 时偶尔晚醒很久, 估计值要慢慢降下来, 不然以后的短等待全变成空转
+		idle_late_ns -= idle_late_ns / 16;
+		return 0;
+	}
+	want_ns -= idle_late_ns;
+
+	static int slack_set;
+	if( !slack_set )
+	{
+		// # 默认 50us 的定时器松弛会让每次醒来都晚一点
+		prctl( PR_SET_TIMERSLACK, 1 );
+		slack_set = 1;
+	}
+
+	struct pollfd fds[SCHED_EVENTS];
+	int owner[SCHED_EVENTS];
+	int n = 0;
+	for( int ev = 0; ev < SCHED_EVENTS; ev++ )
+	{
+		if( !events[ev].watched ) continue;
+		fds[n].fd = events[ev].fd;
+		fds[n].events = events[ev].poll;
+		owner[n++] = ev;
+	}
+
+	struct timespec ts = { want_ns / 1000000000, want_ns % 1000000000 };
+	uint64_t start = MonotonicNs();
+	int r = ppoll( fds, n, timeout_us == SCHED_NEVER ? 0 : &ts, sigmask );
+	if( r == 0 )
+	{
+		uint64_t slept = MonotonicNs() - start;
+		uint64_t late = slept > want_ns ? slept - want_ns : 0;
+		idle_late_ns = idle_late_ns ? ( idle_late_ns * 3 + late ) / 4 : late;
+	}
+	if( r <= 0 ) return 0;
+
+	unsigned mask = 0;
+	for( int i = 0; i < n; i++ )
+		if( fds[i].revents )
+			mask |= 1u << owner[i];
+	SchedWake( mask );
+	return mask;
+}
@@ -0,0 +1,58 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <signal.h>
+
+// # 事件队列: 各设备把下一次需要关注的时刻登记在这里, 按 guest 时间 (mtime, 微秒) 排成小顶堆.
+// # shell 的主循环只看堆顶: 还没到就让 core 一直跑, 到了才调用对应的回调.
+// # 每种事件最多只有一个截止时间, 重新登记就是改键.
+
+enum SchedEvent
+{
+	SCHED_CLINT,	// # mtimecmp 到期, 回调为空: core 进入 step 时自己置 MTIP, 这里只负责让它按时进去
+	SCHED_UART_RX,	// # 定期看一次 stdin 有没有输入, LSR 读到的是缓存的结果
+	SCHED_NET,		// # 网卡: 定期收一次包, 重发积压的包 (空闲时等 socket 可读 / 可写), 都没有时停掉
+	SCHED_EVENTS
+};
+
+#define SCHED_NEVER	UINT64_MAX
+
+typedef void (*SchedFn)( uint64_t now );
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// # 登记 / 改 / 取消 (when = SCHED_NEVER) 事件 ev 的截止时间, fn 可以为 0
+	void SchedSet( enum SchedEvent ev, uint64_t when, SchedFn fn );
+	// # 清空队列 (重启时)
+	void SchedReset();
+	// # 最近的截止时间, 没有时为 SCHED_NEVER
+	uint64_t SchedNext();
+	// # 依次触发所有截止时间 <= now 的事件; 回调里可以重新登记自己
+	void SchedRun( uint64_t now );
+
+	// # 给事件关联一个主机 fd (-1 = 取消). 这种事件的截止时间只是运行时的轮询周期,
+	// # 空闲等待时直接等 fd 可读, 不按它醒来
+	void SchedWatchFd( enum SchedEvent ev, int fd );
+	// # 同上, 但等的是 fd 可写 (比如发送缓冲区满了的 socket)
+	void SchedWatchFdWritable( enum SchedEvent ev, int fd );
+	// # 没有关联 fd 的事件里最近的截止时间
+	uint64_t SchedNextTimed();
+	// # 空闲 (WFI) 时阻塞, 直到过了 timeout_us 微秒主机时间 (SCHED_NEVER = 不限) 或者关联的 fd 就绪;
+	// # fd 就绪的事件经 SchedWake 标记为立即到期, 下一次 SchedRun 时处理. 返回这些事件的位图 (1 << ev).
+	// # sigmask 非 0 时等待期间换成这个信号屏蔽字 (同 ppoll), 被信号打断时返回 0
+	unsigned SchedIdle( uint64_t timeout_us, const sigset_t * sigmask );
+	// # 把位图里的事件标记为立即到期 (重放时代替 SchedIdle)
+	void SchedWake( unsigned mask );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SCHEDULER_H
@@ -6,29 +6,145 @@
 
 #include "hook.h"
 #include "core.h"
+#include "hostmem.h"
+#include "scheduler.h"
+#include "hostclock.h"
+#include "replay.h"
+#include "console.h"
+#include "hostinput.h"
+#include "uart16550.h"
+#include "plic.h"
+#include "mmio.h"
+#include "virtio_blk.h"
+#include "virtio_net.h"
+
+#include <signal.h>
 
 // 见Hook.h中的作用解释
 uint32_t ram_amt = 64*1024*1024;
 int fail_on_all_faults = 0;
+int mmio_yield;
 
 uint8_t * ram_image = 0;
 struct MiniRV32IMAState * core;			// # 主要是各种寄存器
+
+// # Ctrl-C: 信号处理函数只置这个标志, 主循环在两片之间打印状态并退出.
+// # 处理函数里不能 printf: stdout 接到了控制台的环形缓冲区, 主线程自己就是它唯一的生产者
+static volatile sig_atomic_t ctrlc_pending;
+
+// # 板上其余的设备, 和 DTB 一致 (UART, PLIC 的见各自的头文件), 在 MmioInit 里登记
+#define CLINT_BASE		0x11000000
+#define CLINT_SIZE		0x10000
+#define SYSCON_BASE		0x11100000
+#define SYSCON_SIZE		0x1000
+
+// # DTB 放在 RAM 末尾再往前留出这么多字节. 以前 core 就放在这里 (当时 sizeof 为 192),
+// # core 搬出去之后保留这段空位, guest 看到的 DTB 地址和内存大小都不变.
+#define DTB_TAIL_RESERVE	192
 const char * kernel_command_line = 0;
 
+// # syscon 重启 (0x7777) 用的快照: 装载完成时的 CPU 状态, 和 DTB 起往后的 RAM 末尾.
+// # RAM 其余部分由 HostRamRevert 退回 (镜像是写时复制映射进来的), 重启不用重新读文件, 也不用清整个 RAM
+static struct MiniRV32IMAState pristine_core;
+static uint8_t * pristine_tail;
+
+// # UART 接收: 每隔这么久 (guest 时间, 微秒) 把主机输入搬进 RX FIFO, 两次之间 guest 只看得见 FIFO 里已有的.
+// # 看一次已经没有系统调用了, 按时间采样是为了 -r 的日志只记这些时刻, 不记每次 LSR 读
+#define UART_POLL_US	1000
+static int uart_rx_ready;	// # 上一次 IsKBHit 的结果 (-1 = EOF): 1 表示 FIFO 满了, 主机那边还有
+static int uart_irq_level;	// # 上一次交给 PLIC 的 UART 中断线电平
+static int uart_rx_direct;	// # 没有录制 / 重放时 FIFO 空了 LSR 就直接去搬, 输入一到 guest 就看得见
+
+// # 网卡: guest 在跑的时候每隔这么久 (guest 时间, 微秒) 收一次包 / 重发积压的包, 这时也是时间片的上限; 空闲时等 socket 就绪
+#define NET_POLL_US		200
+
+// # guest 时间基准: -l 时 mtime = 指令数 / time_divisor, 否则 = 主机时间 / time_divisor.
+// # lastTime 是已经交给 core (加进 timerl/timerh) 的那部分
+static int time_divisor = 1;
+static int fixed_update = 0;
+static uint64_t lastTime;
+
+// # 自适应时间片 (非 -l): 每片跑多少条由最近的截止时间和实测的执行速度决定, 截止时间临近时缩短, 让中断按时进来.
+// # 上限 QUANTUM_MAX_US 是延迟目标: guest 在一片中间才设的 mtimecmp 要等这一片跑完才看得到.
+// # guest 读 mtime 时现算, 不受时间片长短影响.
+// # -l 时 guest 读到的 mtime 只在进 step 时更新, 时间片仍是 1024 条, 只按截止时间截短.
+#define QUANTUM_MAX_US	1000
+#define QUANTUM_MIN		64
+#define QUANTUM_MAX		( 1 << 26 )
+static double quantum_ips;		// # 每微秒主机时间执行的指令数, 指数平均; 0 = 还没测过
+static uint64_t quantum_count;	// # step 的调用次数, -v 时打印
+
+// # -w: WFI 且没有待读的输入时不等, 直接把 guest 时间拨到最近的截止时间 (批处理跑测试用, 没人看钟).
+// # 一次最多拨 WARP_MAX 个 tick: 进 step 的 elapsedUs 是 32 位的, 更远的截止时间分几次拨
+#define WARP_MAX	0x40000000
+static int warp_idle;
+static uint64_t warp_count, warp_ticks;
+static int do_sleep = 1;
+
+// # 忙等检测: guest 不用 WFI, 而是反复读 mtime 或 UART LSR 等它变化 (udelay, 早期启动的轮询收发).
+// # 连续 SPIN_POLLS 次没有副作用的 MMIO 读 (中间没有 MMIO 写, 没有取走 UART 数据), 相邻两次的 guest 时间
+// # 相差不超过 SPIN_GAP 个 tick (-l 时 step 中间 mtime 不动, 不看间隔), 就当成忙等:
+// #   只读 LSR (在等输入): -w 时拨到最近的定时截止时间; 否则阻塞到 stdin 可读或者最近的截止时间
+// #   读过 mtime (在等时间): -w 时按逐次放大的步长往前拨, 不越过最近的截止时间; 否则只能照实跑
+// # -l 时 cycle 在 step 中间改不了, 记下来等这一片跑完再处理. 做不了什么的轮询计入 spin_spun, -v 时打印
+#define SPIN_POLLS	32
+#define SPIN_GAP	2
+#define SPIN_UART	1
+#define SPIN_MTIME	2
+static int spin_streak;
+static int spin_what;		// # 这一串里读过的寄存器, SPIN_*
+static uint64_t spin_time;	// # 上一次轮询时的 guest 时间
+static int spin_pending;	// # -l: 这一片结束在忙等里
+static uint64_t spin_step;	// # 等时间的忙等每次拨多少, 逐次放大
+static uint64_t spin_loops, spin_spun, spin_skips, spin_skip_ticks, spin_blocks, spin_block_us;
+
 static void DumpState( struct MiniRV32IMAState * core, uint8_t * ram_image );
+static void ReportStats( void );
+static uint64_t GuestTime( void );
+static uint64_t GuestTimeNow( void );
+static uint64_t GuestCycles( void );
+static void UartPoll( uint64_t now );
+static void UartRxUpdate( void );
+static void IrqUpdate( void );
+static void UartIrqUpdate( void );
+static void IdleWait( void );
+static int IdleWarp( void );
+static uint64_t Warp( uint64_t max );
+static uint64_t SpinPoll( int what );
+static void SpinReset( void );
+static int SpinAct( void );
+static int QuantumBudget( uint64_t now, uint64_t next );
+static void QuantumSample( int instrs, uint64_t us );
+static uint64_t ClockRead( void );
+static int KBHit( void );
+static int KBByte( void );
+static void Idle( uint64_t timeout );
+static void NetPoll( uint64_t now );
+static int MmioInit( void );
+static struct VirtioDev * virtio_blk;
+static struct VirtioDev * virtio_net;
 
 int main( int argc, char ** argv )
 {
 	int i;
 	long long instct = -1;
 	int show_help = 0;
-	int time_divisor = 1;
-	int fixed_update = 0;
-	int do_sleep = 1;
 	int single_step = 0;
+	int trace = 0;
+	int guard_mode = 0;
+	int hugetlb = 0;
+	int use_tsc = 0;
+	const char * record_path = 0;
+	const char * replay_path = 0;
+	int verbose = 0;
 	int dtb_ptr = 0;
 	const char * image_file_name = 0;
 	const char * dtb_file_name = 0;
+	const char * engine_name = "jit";
+	const char * bus_name = "flat";
+	const char * disk_file_name = 0;
+	int disk_overlay = 0;
+	const char * net_spec = 0;
 	for( i = 1; i < argc; i++ )
 	{
 		const char * param = argv[i];
@@ -49,6 +165,19 @@ int main( int argc, char ** argv )
 				case 's': param_continue = 1; single_step = 1; break;
 				case 'd': param_continue = 1; fail_on_all_faults = 1; break;
 				case 't': if( ++i < argc ) time_divisor = SimpleReadNumberInt( argv[i], 1 ); break;
+				case 'e': if( ++i < argc ) engine_name = argv[i]; break;
+				case 'B': if( ++i < argc ) bus_name = argv[i]; break;
+				case 'v': param_continue = 1; verbose = 1; atexit( ReportStats ); break;
+				case 'x': param_continue = 1; trace = 1; break;
+				case 'g': param_continue = 1; guard_mode = 1; break;
+				case 'H': param_continue = 1; hugetlb = 1; break;
+				case 'T': param_continue = 1; use_tsc = 1; break;
+				case 'w': param_continue = 1; warp_idle = 1; break;
+				case 'r': if( ++i < argc ) record_path = argv[i]; break;
+				case 'R': if( ++i < argc ) replay_path = argv[i]; break;
+				case 'D': if( ++i < argc ) disk_file_name = argv[i]; break;
+				case 'O': param_continue = 1; disk_overlay = 1; break;
+				case 'N': if( ++i < argc ) net_spec = argv[i]; break;
 				default:
 					if( param_continue )
 						param_continue = 0;
@@ -65,18 +194,59 @@ int main( int argc, char ** argv )
 			param++;
 		} while( param_continue );
 	}
-	if( show_help || image_file_name == 0 || time_divisor <= 0 )
+	// # 引擎和配置只在这里选一次, 预解码引擎拿到的是按 -B / -g / -d / -m / -x 特化好的实例
+	if( guard_mode ) bus_name = "guard";
+	MiniRV32IMAStepFn step = MiniRV32IMASelectStep( engine_name, bus_name, fail_on_all_faults, ram_amt, trace );
+	if( show_help || image_file_name == 0 || time_divisor <= 0 || !step )
 	{
-		fprintf( stderr, "./mini-rv32imaf [parameters]\n\t-m [ram amount]\n\t-f [running image]\n\t-k [kernel command line]\n\t-b [dtb file, or 'disable']\n\t-c instruction count\n\t-s single step with full processor state\n\t-t time divion base\n\t-l lock time base to instruction count\n\t-p disable sleep when wfi\n\t-d fail out immediately on all faults\n" );
+		fprintf( stderr, "./mini-rv32imaf [parameters]\n\t-m [ram amount]\n\t-f [running image]\n\t-k [kernel command line]\n\t-b [dtb file, or 'disable']\n\t-c instruction count\n\t-s single step with full processor state\n\t-t time divion base\n\t-l lock time base to instruction count\n\t-p disable sleep when wfi\n\t-d fail out immediately on all faults\n\t-e [engine: old, my, jit, decoded, threaded]\n\t-v print execution statistics on exit\n\t-x trace executed instructions to stderr (decoded, threaded)\n\t-B [memory bus: flat, checked, trace, paged] (decoded, threaded)\n\t-g guard-page RAM, no software bounds checks (decoded, threaded)\n\t-H back RAM with explicit huge pages (MAP_HUGETLB), fall back to THP\n\t-T time base from the CPU timestamp counter (rdtsc) if invariant\n\t-w skip idle time: on wfi jump guest time to the next timer deadline\n\t-r [file] record time and input to a replay log\n\t-R [file] replay a log recorded with -r (same options; engine and bus may differ)\n\t-D [file] attach a disk image as a virtio block device (mmap'd, writes go to the file)\n\t-O copy-on-write overlay for -D: guest writes are kept in memory, the image is not modified\n\t-N [path:peer | fd:N] attach a virtio network device to a Unix datagram socket (bound to path, connected to peer), or to an inherited one (e.g. from socketpair)\n" );
 		return 1;
 	}
-
-	ram_image = malloc( ram_amt );	// # 分配内存8787
+	if( net_spec && ( record_path || replay_path ) )
+	{
+		fprintf( stderr, "Error: -N cannot be combined with -r / -R, received packets are not logged.\n" );
+		return 1;
+	}
+	if( record_path || replay_path )
+	{
+		// # 换算系数必须和录制时一样, TSC 的频率每次校准都不同
+		if( use_tsc ) fprintf( stderr, "Warning: -T is ignored when recording or replaying.\n" );
+		use_tsc = 0;
+		struct ReplayHeader hdr = { ram_amt, time_divisor, fixed_update | warp_idle << 1 | !do_sleep << 2 | single_step << 3 };
+		if( ReplayOpen( replay_path ? replay_path : record_path, replay_path != 0, &hdr ) ) return 1;
+		atexit( ReplayClose );
+	}
+	ConsoleInit();
+	if( !replay_path ) HostInputInit();	// # 重放时不读 stdin
+	uart_rx_direct = !record_path && !replay_path;
+	HostClockInit( use_tsc, time_divisor );
+	virtio_blk = VirtioBlkInit( disk_file_name, disk_overlay );
+	virtio_net = VirtioNetInit( net_spec );
+	if( !virtio_blk || !virtio_net ) return 1;
+	if( MmioInit() ) return 1;
+
+	if( guard_mode )
+	{
+		// # guard 模式: RAM 放进 4GiB 保留区, 预解码引擎改用不检查范围的 guard bus
+		ram_image = MiniRV32IMAGuardAlloc( ram_amt, hugetlb );
+		if( !ram_image )
+		{
+			fprintf( stderr, "Warning: could not reserve guard address space, using plain RAM.\n" );
+			step = MiniRV32IMASelectStep( engine_name, "flat", fail_on_all_faults, ram_amt, trace );
+		}
+	}
+	if( !ram_image )
+		ram_image = HostRamAlloc( ram_amt, hugetlb );	// # 2MiB 对齐 + 大页, 见 hostmem.h
 	if( !ram_image )
+		ram_image = malloc( ram_amt );	// # 分配内存8787
+	core = aligned_alloc( 64, sizeof( struct MiniRV32IMAState ) );	// # 状态独立于 guest RAM, guest 的写入不会碰到它
+	if( !ram_image || !core )
 	{
 		fprintf( stderr, "Error: could not allocate system image.\n" );
 		return -4;
 	}
+	MiniRV32IMAAttachRam( ram_image, ram_amt );
+	VirtioAttachRam( ram_image, ram_amt );
 
 restart:
 	{
@@ -95,13 +265,15 @@ restart:
 			return -6;
 		}
 
-		memset( ram_image, 0, ram_amt );	// # 清零
-		if( fread( ram_image, flen, 1, f ) != 1)
+		HostRamClear( ram_image, ram_amt );	// # 清零 (mmap 的 RAM 只是丢掉页, 不逐字节写)
+		// # 镜像优先直接映射进 RAM, 按需读入; 不行再整个读进来
+		if( HostRamLoadFile( ram_image, fileno( f ), flen ) && fread( ram_image, flen, 1, f ) != 1 )
 		{
 			fprintf( stderr, "Error: Could not load image.\n" );
 			return -7;
 		}
 		fclose( f );
+		MiniRV32IMAFlushDecoded();	// # 镜像重新装载过, 解码缓存全部作废
 
 		if( dtb_file_name )
 		{
@@ -120,7 +292,7 @@ restart:
 				fseek( f, 0, SEEK_END );
 				long dtblen = ftell( f );
 				fseek( f, 0, SEEK_SET );
-				dtb_ptr = ram_amt - dtblen - sizeof( struct MiniRV32IMAState );
+				dtb_ptr = ram_amt - dtblen - DTB_TAIL_RESERVE;
 				if( fread( ram_image + dtb_ptr, dtblen, 1, f ) != 1 )
 				{
 					fprintf( stderr, "Error: Could not open dtb \"%s\"\n", dtb_file_name );
@@ -132,7 +304,7 @@ restart:
 		else
 		{
 			// Load a default dtb.
-			dtb_ptr = ram_amt - sizeof(default64mbdtb) - sizeof( struct MiniRV32IMAState );
+			dtb_ptr = ram_amt - sizeof(default64mbdtb) - DTB_TAIL_RESERVE;
 			memcpy( ram_image + dtb_ptr, default64mbdtb, sizeof( default64mbdtb ) );
 			if( kernel_command_line )
 			{
@@ -141,10 +313,15 @@ restart:
 		}
 	}
 
+	if( verbose )
+	{
+		HostRamReport( ram_image, ram_amt );	// # RAM 按需分配, 这里只有镜像和 DTB 驻留; 退出时再报一次
+		verbose = 0;	// # 重启后不再报告
+	}
+
 	CaptureKeyboardInput();
 
-	// The core lives at the end of RAM.
-	core = (struct MiniRV32IMAState *)(ram_image + ram_amt - sizeof( struct MiniRV32IMAState ));
+	memset( core, 0, sizeof( struct MiniRV32IMAState ) );
 	core->pc = MINIRV32_RAM_IMAGE_OFFSET;
 	core->regs[10] = 0x00; //hart ID
 	core->regs[11] = dtb_ptr?(dtb_ptr+MINIRV32_RAM_IMAGE_OFFSET):0; //dtb_pa (Must be valid pointer) (Should be pointer to dtb)
@@ -164,31 +341,102 @@ restart:
 
 	// Image is loaded.
 	uint64_t rt;
-	uint64_t lastTime = (fixed_update)?0:(GetTimeMicroseconds()/time_divisor);
 	int instrs_per_flip = single_step?1:1024;
-	for( rt = 0; rt < instct+1 || instct < 0; rt += instrs_per_flip )
+
+	if( dtb_ptr )
 	{
+		free( pristine_tail );
+		pristine_tail = malloc( ram_amt - dtb_ptr );
+		if( pristine_tail ) memcpy( pristine_tail, ram_image + dtb_ptr, ram_amt - dtb_ptr );
+	}
+	memcpy( &pristine_core, core, sizeof( struct MiniRV32IMAState ) );
+
+reboot:
+	lastTime = (fixed_update)?0:HostClockTicks( ClockRead() );
+	SchedReset();
+	SchedSet( SCHED_UART_RX, GuestTime(), UartPoll );
+	SpinReset();
+	UartReset();
+	PlicReset();
+	VirtioReset( virtio_blk );
+	VirtioReset( virtio_net );
+	int budget = instrs_per_flip;
+	int ret = 1;
+	int retired = -1;	// # 上一片实际退休的指令数, -1 表示不用来估计速度
+	uint64_t now_us = 0;
+	for( rt = 0; rt < instct+1 || instct < 0; rt += budget )
+	{
+		if( ctrlc_pending )
+		{
+			DumpState( core, ram_image );
+			exit( 0 );
+		}
+
 		uint64_t * this_ccount = ((uint64_t*)&core->cyclel);
 		uint32_t elapsedUs = 0;
 		if( fixed_update )
 			elapsedUs = *this_ccount / time_divisor - lastTime;
 		else
-			elapsedUs = GetTimeMicroseconds()/time_divisor - lastTime;
+		{
+			uint64_t prev_us = now_us;
+			uint64_t raw = ClockRead();
+			now_us = HostClockUs( raw );
+			if( retired >= 0 ) QuantumSample( retired, now_us - prev_us );	// # 用上一片的实际指令数估计执行速度
+			elapsedUs = HostClockTicks( raw ) - lastTime;
+		}
 		lastTime += elapsedUs;
 
 		if( single_step )
 			DumpState( core, ram_image);
 
-		//int ret = MiniRV32IMAStep( core, ram_image, 0, elapsedUs, instrs_per_flip ); // Execute upto 1024 cycles before breaking out.
-		//int ret = MyMiniRV32IMAStep(core, ram_image, 0, elapsedUs, instrs_per_flip);
-		int ret = SingleMiniRV32IMAStep(core, ram_image, 0, elapsedUs, instrs_per_flip);
+		// # step 一进去就把 mtime 推进 elapsedUs, 以那个时刻为准先处理到期的事件
+		SchedRun( GuestTime() + elapsedUs );
+
+		// # -l 时 guest 时间就是指令数 / time_divisor, 可以精确地只跑到最近的截止时间, 进 step 时正好到期
+		budget = instrs_per_flip;
+		uint64_t next = SchedNext();
+		if( fixed_update && next < SCHED_NEVER / time_divisor )
+		{
+			uint64_t at = next * time_divisor;
+			if( at > *this_ccount && at - *this_ccount < budget ) budget = at - *this_ccount;
+		}
+		else if( !fixed_update && !single_step )
+			budget = QuantumBudget( GuestTime() + elapsedUs, next );
+		if( instct >= 0 && budget > instct + 1 - rt ) budget = instct + 1 - rt;	// # -c: 最后一片不超出指令数
+
+		ConsoleFlush();	// # 上一片攒下的半行输出交给写线程
+		quantum_count++;
+		spin_pending = 0;
+		IrqUpdate();	// # guest 可能用 csrw 改过 mip
+		mmio_yield = 0;
+		uint64_t before = GuestCycles();
+		ret = step( core, ram_image, 0, elapsedUs, budget );
+		retired = GuestCycles() - before;	// # 陷入, 中断, mmio_yield 都会让 step 提前返回 0, 不能按 budget 算
+		if( spin_pending && ret == 0 )
+			SpinAct();
 
 		switch( ret )
 		{
 			case 0: break;
-			case 1: if( do_sleep ) MiniSleep(); *this_ccount += instrs_per_flip; break;
+			case 1:
+				retired = -1;	// # 这一片的墙钟时间里有睡眠, 不参与估计
+				if( core->mip & (1<<11) ) break;	// # WFI 时已经挂着外部中断, 下一片进去就醒
+				if( warp_idle && IdleWarp() ) break;
+				if( do_sleep ) IdleWait();
+				*this_ccount += instrs_per_flip;
+				break;
 			case 3: instct = 0; break;
-			case 0x7777: goto restart;	//syscon code for restart
+			case 0x7777:	//syscon code for restart
+				ReplayInput( REPLAY_RESTART, GuestCycles(), 0 );
+				// # 快速重启: 只退回 guest 弄脏的页, 再放回 DTB 和 CPU 状态; 做不到时走完整的重新装载
+				if( ( !dtb_ptr || pristine_tail ) && HostRamRevert( ram_image, ram_amt ) == 0 )
+				{
+					if( dtb_ptr ) memcpy( ram_image + dtb_ptr, pristine_tail, ram_amt - dtb_ptr );
+					memcpy( core, &pristine_core, sizeof( struct MiniRV32IMAState ) );
+					MiniRV32IMAFlushDecoded();
+					goto reboot;
+				}
+				goto restart;
 			case 0x5555: printf( "POWEROFF@0x%08x%08x\n", core->cycleh, core->cyclel ); return 0; //syscon code for power-off
 			default: printf( "Unknown failure\n" ); break;
 		}
@@ -197,102 +445,278 @@ restart:
 	DumpState( core, ram_image);
 }
 
+// # -v: 退出时打印统计 (预解码引擎的指令融合命中率, RAM 的驻留量和大页覆盖率, 主机时钟的开销)
+static void ReportStats( void )
+{
+	if( core )
+		MiniRV32IMAReportFusion( ( (uint64_t)core->cycleh << 32 ) | core->cyclel );
+	if( ram_image )
+		HostRamReport( ram_image, ram_amt );
+	ReplayReport();
+	MmioReport();
+	VirtioBlkReport();
+	VirtioNetReport();
+	ConsoleReport();
+	HostInputReport();
+	if( !fixed_update )
+		HostClockReport();
+	if( warp_count )
+		fprintf( stderr, "idle warps: %llu, %.3f s of guest time skipped\n", (unsigned long long)warp_count,
+			(double)warp_ticks * time_divisor / 1e6 );
+	if( spin_loops )
+		fprintf( stderr, "busy-wait: %llu loops, %llu fast-forwards (%.3f s guest time), %llu blocks (%.3f s), %llu polls spun\n",
+			(unsigned long long)spin_loops, (unsigned long long)spin_skips, (double)spin_skip_ticks * time_divisor / 1e6,
+			(unsigned long long)spin_blocks, spin_block_us / 1e6, (unsigned long long)spin_spun );
+	if( core && quantum_count )
+		fprintf( stderr, "quanta: %llu, %llu instructions each on average\n", (unsigned long long)quantum_count,
+			(unsigned long long)( ( ( (uint64_t)core->cycleh << 32 ) | core->cyclel ) / quantum_count ) );
+}
 
-//////////////////////////////////////////////////////////////////////////
-// Platform-specific functionality
-//////////////////////////////////////////////////////////////////////////
+static uint64_t GuestTime( void )
+{
+	return ( (uint64_t)core->timerh << 32 ) | core->timerl;
+}
 
+static uint64_t GuestCycles( void )
+{
+	return ( (uint64_t)core->cycleh << 32 ) | core->cyclel;
+}
 
-#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+// # guest 此刻读 mtime 应得的值: 非 -l 时把上次进 step 以来流逝的主机时间也算上
+static uint64_t GuestTimeNow( void )
+{
+	if( fixed_update )
+		return GuestTime();
+	return GuestTime() + HostClockTicks( ClockRead() ) - lastTime;
+}
 
-#include <windows.h>
-#include <conio.h>
+static int QuantumBudget( uint64_t now, uint64_t next )
+{
+	if( quantum_ips <= 0 ) return 1024;
+	double us = QUANTUM_MAX_US;
+	if( next != SCHED_NEVER && (double)( next - now ) * time_divisor < us )
+		us = (double)( next - now ) * time_divisor;	// # SchedRun 之后 next 一定比 now 晚
+	double n = us * quantum_ips;
+	return n < QUANTUM_MIN ? QUANTUM_MIN : n > QUANTUM_MAX ? QUANTUM_MAX : (int)n;
+}
 
-#define strtoll _strtoi64
+static void QuantumSample( int instrs, uint64_t us )
+{
+	// # 短的时间片只有几微秒, 时钟精度不够, 攒够一个 QUANTUM_MAX_US 再算一次
+	static uint64_t sum_instrs, sum_us;
+	sum_instrs += instrs;
+	sum_us += us;
+	if( sum_us < QUANTUM_MAX_US ) return;
+	double ips = (double)sum_instrs / sum_us;
+	quantum_ips = quantum_ips > 0 ? quantum_ips * 0.75 + ips * 0.25 : ips;
+	sum_instrs = sum_us = 0;
+}
 
-void CaptureKeyboardInput()
+// # guest 看得到的不确定输入都从这几个函数进来, 录制 / 重放 (-r / -R, replay.h) 插在这里.
+// # 指令计数用所在时间片开头的 cycle, 一片里的先后由顺序决定
+static uint64_t ClockRead( void )
 {
-	system(""); // Poorly documented tick: Enable VT100 Windows mode.
+	return ReplayInput( REPLAY_CLOCK, GuestCycles(), ReplayPlaying() ? 0 : HostClockRead() );
 }
 
-void ResetKeyboardInput()
+static int KBHit( void )
 {
+	return ReplayInput( REPLAY_KBHIT, GuestCycles(), ReplayPlaying() ? 0 : IsKBHit() );
 }
 
-void MiniSleep()
+static int KBByte( void )
 {
-	Sleep(1);
+	return ReplayInput( REPLAY_KBBYTE, GuestCycles(), ReplayPlaying() ? 0 : ReadKBByte() );
 }
 
-uint64_t GetTimeMicroseconds()
+// # 重放时不真的等, 按日志标记醒来的事件
+// # 等待期间才放开 SIGINT (ppoll 原子地换屏蔽字), 不会出现标志刚置上就睡下去、一直等到超时的情况
+static void Idle( uint64_t timeout )
 {
-	static LARGE_INTEGER lpf;
-	LARGE_INTEGER li;
+	ConsoleFlush();
+	ReplayFlush();
+	sigset_t intr, old;
+	sigemptyset( &intr );
+	sigaddset( &intr, SIGINT );
+	pthread_sigmask( SIG_BLOCK, &intr, &old );
+	unsigned mask = ReplayInput( REPLAY_IDLE, GuestCycles(), ReplayPlaying() || ctrlc_pending ? 0 : SchedIdle( timeout, &old ) );
+	pthread_sigmask( SIG_SETMASK, &old, 0 );
+	if( ReplayPlaying() ) SchedWake( mask );
+}
 
-	if( !lpf.QuadPart )
-		QueryPerformanceFrequency( &lpf );
+static void UartPoll( uint64_t now )
+{
+	UartRxUpdate();
+	if( uart_rx_ready >= 0 )	// # EOF 之后不会再有输入, 不用再看
+		SchedSet( SCHED_UART_RX, now + UART_POLL_US, UartPoll );
+}
 
-	QueryPerformanceCounter( &li );
-	return ((uint64_t)li.QuadPart * 1000000LL) / (uint64_t)lpf.QuadPart;
+static void UartRxUpdate( void )
+{
+	// # 主机输入搬进 RX FIFO, 放不下的留在读线程的缓冲区里, guest 取走之后再搬
+	while( UartRxRoom() > 0 && ( uart_rx_ready = KBHit() ) > 0 )
+		UartRxPush( KBByte() );
+	// # 空闲时等读线程叫醒; 主机那边还有输入 (或 EOF), 或者 FIFO 满了时不等, 否则 guest 不读它就会一直被唤醒.
+	// # 重放时不会真的等, 但事件要和录制时一样算作等 fd 的 (SchedNextTimed 不看它)
+	int full = uart_rx_ready || UartRxRoom() <= 0;
+	SchedWatchFd( SCHED_UART_RX, full ? -1 : ReplayPlaying() ? fileno( stdin ) : HostInputWaitFd() );
+	UartIrqUpdate();
 }
 
+// # UART 的中断线接到 PLIC, PLIC 的输出就是 mip.MEIP. 设备状态变了就调用;
+// # 在 step 里面新挂上的外部中断让这一片在这条指令之后结束, 下一片进去就响应
+static void IrqUpdate( void )
+{
+	uart_irq_level = UartIrq();
+	PlicSetLevel( PLIC_IRQ_UART, uart_irq_level );
+	if( PlicPending() )
+	{
+		if( !( core->mip & (1<<11) ) ) mmio_yield = 1;
+		core->mip |= 1<<11;
+	}
+	else
+		core->mip &= ~(1<<11);
+}
 
-int IsKBHit()
+// # UART 寄存器读写之后: 中断线没变就不用重算 PLIC (guest 往 THR 一个个写字节时每次都走这里)
+static void UartIrqUpdate( void )
 {
-	return _kbhit();
+	if( UartIrq() != uart_irq_level ) IrqUpdate();
 }
 
-int ReadKBByte()
+// # WFI: 阻塞到最近的截止时间 (主机时间) 或者 stdin 有输入为止.
+// # -l 时 guest 时间不随主机时间走, 还是每次最多等 500us
+static void IdleWait( void )
 {
-	// This code is kind of tricky, but used to convert windows arrow keys
-	// to VT100 arrow keys.
-	static int is_escape_sequence = 0;
-	int r;
-	if( is_escape_sequence == 1 )
+	uint64_t timeout = 500;
+	if( !fixed_update )
 	{
-		is_escape_sequence++;
-		return '[';
+		uint64_t next = SchedNextTimed();
+		uint64_t now = GuestTimeNow();
+		if( next == SCHED_NEVER )
+			timeout = SCHED_NEVER;
+		else
+			timeout = next > now ? ( next - now ) * time_divisor : 0;
 	}
+	if( timeout )
+		Idle( timeout );
+}
 
-	r = _getch();
+// # 把 guest 时间往前拨最多 max 个 tick, 不越过最近的定时截止时间, 也不超过 WARP_MAX; 返回拨了多少 (截止时间已到时为 0).
+// # -l 时 mtime = 指令数 / time_divisor, 拨的是 cycle, timer 在下次进 step 时按同样的关系跟上, 只能在两片之间调用;
+// # 否则 mtime 跟着主机时钟走, 把 lastTime 往回拨, GuestTimeNow 立即看到, 下次进 step 时多出来的部分一起加进 timer
+static uint64_t Warp( uint64_t max )
+{
+	uint64_t next = SchedNextTimed();
+	uint64_t now = fixed_update ? GuestCycles() / time_divisor : GuestTimeNow();
+	if( next <= now ) return 0;
+	uint64_t delta = next - now;
+	if( delta > max ) delta = max;
+	if( delta > WARP_MAX ) delta = WARP_MAX;
+	if( fixed_update )
+	{
+		uint64_t cycles = ( now + delta ) * time_divisor;
+		core->cyclel = (uint32_t)cycles;
+		core->cycleh = (uint32_t)( cycles >> 32 );
+	}
+	else
+		lastTime -= delta;
+	return delta;
+}
 
-	if( is_escape_sequence )
+// # -w 的 WFI: 返回 1 表示不用再等了.
+// # 没有定时的截止时间 (只剩等输入) 时返回 0, 照常空闲等待
+static int IdleWarp( void )
+{
+	UartRxUpdate();
+	if( core->mip & (1<<11) ) return 1;	// # 刚挂上外部中断, 直接回去响应
+	if( SchedNextTimed() == SCHED_NEVER ) return 0;
+	uint64_t delta = Warp( SCHED_NEVER );
+	if( delta )
 	{
-		is_escape_sequence = 0;
-		switch( r )
+		warp_count++;
+		warp_ticks += delta;
+	}
+	return 1;
+}
+
+static void SpinReset( void )
+{
+	spin_streak = 0;
+	spin_what = 0;
+	spin_step = 1;
+}
+
+// # 对确认了的忙等做点什么, 返回 1 表示拨过时间或者等过了
+static int SpinAct( void )
+{
+	if( warp_idle )
+	{
+		// # 只等输入: 能带来变化的只有定时的截止时间, 直接拨过去 (没有就不拨);
+		// # 等时间: 不知道 guest 要等到什么时候, 步长每次乘 5/4, 多拨的不超过要等的 1/4
+		uint64_t max = spin_step;
+		if( spin_what == SPIN_UART ) max = SchedNextTimed() == SCHED_NEVER ? 0 : SCHED_NEVER;
+		uint64_t delta = Warp( max );
+		if( delta )
 		{
-			case 'H': return 'A'; // Up
-			case 'P': return 'B'; // Down
-			case 'K': return 'D'; // Left
-			case 'M': return 'C'; // Right
-			case 'G': return 'H'; // Home
-			case 'O': return 'F'; // End
-			default: return r; // Unknown code.
+			if( spin_step < WARP_MAX ) spin_step += spin_step / 4 + 1;
+			spin_skips++;
+			spin_skip_ticks += delta;
+			return 1;
 		}
 	}
-	else
+	if( spin_what == SPIN_UART && do_sleep )
 	{
-		switch( r )
+		// # 只在等输入时阻塞 (同时读 mtime 的多半带超时, 不知道它要等多久); 醒来时马上刷新 LSR.
+		// # -l 时 guest 时间不走, 只有没有定时的截止时间时才能等
+		uint64_t next = SchedNextTimed();
+		uint64_t now = GuestTimeNow();
+		uint64_t timeout = next == SCHED_NEVER ? SCHED_NEVER : fixed_update || next <= now ? 0 : ( next - now ) * time_divisor;
+		if( timeout )
 		{
-			case 13: return 10; //cr->lf
-			case 224: is_escape_sequence = 1; return 27; // Escape arrow keys
-			default: return r;
+			uint64_t t0 = HostClockUs( HostClockRead() );
+			Idle( timeout );
+			spin_blocks++;
+			spin_block_us += HostClockUs( HostClockRead() ) - t0;
+			UartRxUpdate();
+			return 1;
 		}
 	}
+	return 0;
 }
 
-#else
+// # guest 读了一个没有副作用的寄存器 (LSR 时还没有输入). 返回 guest 此刻的时间 (拨过或者等过之后的)
+static uint64_t SpinPoll( int what )
+{
+	uint64_t now = GuestTimeNow();
+	if( !fixed_update && now - spin_time > SPIN_GAP ) SpinReset();
+	spin_time = now;
+	spin_what |= what;
+	if( ++spin_streak < SPIN_POLLS ) return now;
+	if( spin_streak == SPIN_POLLS ) spin_loops++;
+
+	if( !fixed_update && SpinAct() )
+	{
+		spin_time = GuestTimeNow();	// # 拨过去的部分不算轮询间隔
+		return spin_time;
+	}
+	spin_pending = fixed_update;	// # -l: cycle 在 step 中间改不了, 这一片跑完再说
+	spin_spun++;
+	return now;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Platform-specific functionality
+//////////////////////////////////////////////////////////////////////////
+
 
-#include <sys/ioctl.h>
 #include <termios.h>
 #include <unistd.h>
 #include <signal.h>
-#include <sys/time.h>
 
 void CtrlC(int sig)
 {
-	DumpState( core, ram_image);
-	exit( 0 );
+	ctrlc_pending = 1;
 }
 
 // Override keyboard, so we can capture all keyboard input for the VM.
@@ -324,38 +748,21 @@ void MiniSleep()
 
 uint64_t GetTimeMicroseconds()
 {
-	struct timeval tv;
-	gettimeofday( &tv, 0 );
-	return tv.tv_usec + ((uint64_t)(tv.tv_sec)) * 1000000LL;
+	return HostClockUs( HostClockRead() );
 }
 
-static int is_eofd;
-
+// # stdin 由 hostinput 的读线程读进缓冲区, 这里只看内存
 int ReadKBByte()
 {
-	if( is_eofd ) return 0xffffffff;
-	char rxchar = 0;
-	int rread = read(fileno(stdin), (char*)&rxchar, 1);
-
-	if( rread > 0 ) // Tricky: getchar can't be used with arrow keys.
-		return rxchar;
-	else
-		return -1;
+	return HostInputByte();
 }
 
 int IsKBHit()
 {
-	if( is_eofd ) return -1;
-	int byteswaiting;
-	ioctl(0, FIONREAD, &byteswaiting);
-	if( !byteswaiting && write( fileno(stdin), 0, 0 ) != 0 ) { is_eofd = 1; return -1; } // Is end-of-file for
-	return !!byteswaiting;
+	return HostInputReady();
 }
 
 
-#endif
-
-
 //////////////////////////////////////////////////////////////////////////
 // Rest of functions functionality
 //////////////////////////////////////////////////////////////////////////
@@ -372,35 +779,138 @@ uint32_t HandleException( uint32_t ir, uint32_t code )
 
 uint32_t HandleControlStore( uint32_t addy, uint32_t val )
 {
-	if( addy == 0x10000000 ) //UART 8250 / 16550 Data Buffer
+	SpinReset();
+	return MmioStore( addy, val );
+}
+
+uint32_t HandleControlLoad( uint32_t addy )
+{
+	return MmioLoad( addy );
+}
+
+// Emulating a 8250 / 16550 UART
+// # 录制 / 重放时 FIFO 只在 UartPoll 时补; 取走一个字节后马上再补, 连续输入不用等下一轮
+static uint32_t UartMmioLoad( void * ctx, uint32_t ofs )
+{
+	if( ofs == 5 )
 	{
-		printf( "%c", val );
-		fflush( stdout );
+		if( !UartRxCount() && uart_rx_direct && uart_rx_ready >= 0 ) UartRxUpdate();
+		if( UartRxCount() ) SpinReset();
+		else
+		{
+			SpinPoll( SPIN_UART );	// # 可能在里面等到了输入
+			if( !UartRxCount() && uart_rx_ready < 0 ) return 0xffffffff;	// # 原版的行为: stdin 读完之后 LSR 全 1, 测试程序靠它结束
+		}
+		return UartLoad( 5 );
 	}
-	else if( addy == 0x11004004 ) //CLNT
-		core->timermatchh = val;
-	else if( addy == 0x11004000 ) //CLNT
-		core->timermatchl = val;
-	else if( addy == 0x11100000 ) //SYSCON (reboot, poweroff, etc.)
+	uint32_t val = UartLoad( ofs );
+	if( ofs == 0 )
 	{
-		core->pc = core->pc + 4;
-		return val; // NOTE: PC will be PC of Syscon.
+		SpinReset();
+		UartRxUpdate();
 	}
+	else
+		UartIrqUpdate();	// # 读 IIR 会清掉 THRE 中断
+	return val;
+}
+
+static uint32_t UartMmioStore( void * ctx, uint32_t ofs, uint32_t val )
+{
+	if( UartStore( ofs, val ) ) UartIrqUpdate();
 	return 0;
 }
 
+static uint32_t PlicMmioLoad( void * ctx, uint32_t ofs )
+{
+	uint32_t val = PlicLoad( ofs );	// # claim
+	IrqUpdate();
+	return val;
+}
 
-uint32_t HandleControlLoad( uint32_t addy )
+static uint32_t PlicMmioStore( void * ctx, uint32_t ofs, uint32_t val )
+{
+	PlicStore( ofs, val );
+	IrqUpdate();
+	return 0;
+}
+
+// # https://chromitem-soc.readthedocs.io/en/latest/clint.html
+static uint32_t ClintLoad( void * ctx, uint32_t ofs )
+{
+	if( ofs == 0xbffc ) return SpinPoll( SPIN_MTIME ) >> 32;
+	if( ofs == 0xbff8 ) return SpinPoll( SPIN_MTIME );
+	return 0;
+}
+
+static uint32_t ClintStore( void * ctx, uint32_t ofs, uint32_t val )
+{
+	if( ofs == 0x4004 )
+		core->timermatchh = val;
+	else if( ofs == 0x4000 )
+		core->timermatchl = val;
+	else
+		return 0;
+	// # core 在 mtime > mtimecmp 时置 MTIP, mtimecmp 为 0 表示关闭
+	uint64_t match = ( (uint64_t)core->timermatchh << 32 ) | core->timermatchl;
+	SchedSet( SCHED_CLINT, match ? match + 1 : SCHED_NEVER, 0 );
+	return 0;
+}
+
+//SYSCON (reboot, poweroff, etc.)
+static uint32_t SysconStore( void * ctx, uint32_t ofs, uint32_t val )
+{
+	if( ofs ) return 0;
+	core->pc = core->pc + 4;
+	return val; // NOTE: PC will be PC of Syscon.
+}
+
+// # virtio 设备: 写寄存器可能完成请求 (拉高中断线) 或者应答中断 (放下), 之后重新算 MEIP; 读没有副作用
+static uint32_t VirtioMmioStore( void * ctx, uint32_t ofs, uint32_t val )
+{
+	VirtioStore( ctx, ofs, val );
+	IrqUpdate();
+	return 0;
+}
+
+// # 网卡: guest 通知了 rx 队列 (补了接收缓冲区) 就在下一片开始时收一次包; tx 队列的包在 VirtioStore 里已经发掉了
+static uint32_t NetMmioStore( void * ctx, uint32_t ofs, uint32_t val )
+{
+	VirtioStore( ctx, ofs, val );
+	if( ofs == 0x050 ) SchedSet( SCHED_NET, GuestTime(), NetPoll );
+	IrqUpdate();
+	return 0;
+}
+
+// # 有接收缓冲区 (或者积压的包) 时每 NET_POLL_US 轮询一次, 空闲时等 socket 可读 (可写);
+// # 都没有就停下, 等 guest 补了缓冲区再通知过来
+static void NetPoll( uint64_t now )
+{
+	int fd;
+	int wait = VirtioNetPoll( &fd );
+	if( wait == VIRTIO_NET_WRITE )
+		SchedWatchFdWritable( SCHED_NET, fd );
+	else
+		SchedWatchFd( SCHED_NET, wait == VIRTIO_NET_READ ? fd : -1 );
+	IrqUpdate();
+	SchedSet( SCHED_NET, wait == VIRTIO_NET_STOP ? SCHED_NEVER : now + NET_POLL_US, NetPoll );
+}
+
+// # 登记失败 (和已有设备重叠, 或超出 MMIO 窗口) 时设备就没有映射上, guest 只会看到访问异常, 这里报出来
+static int MmioAdd( const char * name, uint32_t base, uint32_t size, MmioLoadFn load, MmioStoreFn store, void * ctx )
+{
+	if( MmioRegister( name, base, size, load, store, ctx ) == 0 ) return 0;
+	fprintf( stderr, "Error: could not map MMIO device \"%s\" at 0x%08x (+0x%x)\n", name, base, size );
+	return -1;
+}
+
+static int MmioInit( void )
 {
-	// Emulating a 8250 / 16550 UART
-	if( addy == 0x10000005 )
-		return 0x60 | IsKBHit();
-	else if( addy == 0x10000000 && IsKBHit() )
-		return ReadKBByte();
-	else if( addy == 0x1100bffc ) // https://chromitem-soc.readthedocs.io/en/latest/clint.html
-		return core->timerh;
-	else if( addy == 0x1100bff8 )
-		return core->timerl;
+	if( MmioAdd( "plic", PLIC_BASE, PLIC_SIZE, PlicMmioLoad, PlicMmioStore, 0 ) ) return -1;
+	if( MmioAdd( "uart", UART_BASE, 8, UartMmioLoad, UartMmioStore, 0 ) ) return -1;
+	if( MmioAdd( "clint", CLINT_BASE, CLINT_SIZE, ClintLoad, ClintStore, 0 ) ) return -1;
+	if( MmioAdd( "syscon", SYSCON_BASE, SYSCON_SIZE, 0, SysconStore, 0 ) ) return -1;
+	if( MmioAdd( "virtio-blk", VIRTIO_BLK_BASE, 0x1000, VirtioLoad, VirtioMmioStore, virtio_blk ) ) return -1;
+	if( MmioAdd( "virtio-net", VIRTIO_NET_BASE, 0x1000, VirtioLoad, NetMmioStore, virtio_net ) ) return -1;
 	return 0;
 }
 
@@ -439,8 +949,8 @@ int32_t HandleOtherCSRRead( uint8_t * image, uint16_t csrno )
 {
 	if( csrno == 0x140 )
 	{
-		if( !IsKBHit() ) return -1;
-		return ReadKBByte();
+		if( !UartRxCount() ) UartRxUpdate();
+		return UartRxPop();
 	}
 	return 0;
 }
@@ -0,0 +1,146 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#include "uart16550.h"
+#include "console.h"
+
+#define IER_ERBFI	0x01	// # 接收数据 (和字符超时) 中断
+#define IER_ETBEI	0x02	// # THR 空中断
+#define FCR_ENABLE	0x01
+#define FCR_CLEAR_RX	0x02
+#define LCR_DLAB	0x80
+#define MCR_LOOP	0x10
+#define LSR_DR		0x01
+#define LSR_THRE	0x20
+#define LSR_TEMT	0x40
+#define IIR_NONE	0x01
+#define IIR_THRE	0x02
+#define IIR_RDA		0x04
+#define IIR_TIMEOUT	0x0c
+#define IIR_FIFO	0xc0
+
+static const uint8_t trigger_levels[4] = { 1, 4, 8, 14 };
+
+static uint8_t rx[UART_FIFO];
+static int rx_head, rx_count;
+static uint8_t ier, lcr, mcr, scr, dll, dlm;
+static uint8_t fcr;			// # 只记使能位和触发深度, 清 FIFO 的位写了就做
+static int thre_pending;	// # THR 空中断挂起, 读 IIR 报出它 (或者写 THR) 时清掉
+
+void UartReset( void )
+{
+	rx_head = rx_count = 0;
+	ier = lcr = mcr = scr = fcr = dlm = 0;
+	dll = 12;
+	thre_pending = 0;
+}
+
+// # FIFO 关着时就是 16450: 只有一个字节的接收保持寄存器
+int UartRxRoom( void )
+{
+	return ( fcr & FCR_ENABLE ? UART_FIFO : 1 ) - rx_count;
+}
+
+int UartRxCount( void )
+{
+	return rx_count;
+}
+
+void UartRxPush( uint8_t c )
+{
+	if( UartRxRoom() <= 0 ) return;
+	rx[( rx_head + rx_count ) % UART_FIFO] = c;
+	rx_count++;
+}
+
+int UartRxPop( void )
+{
+	if( !rx_count ) return -1;
+	uint8_t c = rx[rx_head];
+	rx_head = ( rx_head + 1 ) % UART_FIFO;
+	rx_count--;
+	return c;
+}
+
+static uint32_t Identify( void )
+{
+	uint32_t fifo = fcr & FCR_ENABLE ? IIR_FIFO : 0;
+	if( ( ier & IER_ERBFI ) && rx_count )
+	{
+		if( !fifo || rx_count >= trigger_levels[fcr >> 6] ) return fifo | IIR_RDA;
+		return fifo | IIR_TIMEOUT;
+	}
+	if( ( ier & IER_ETBEI ) && thre_pending ) return fifo | IIR_THRE;
+	return fifo | IIR_NONE;
+}
+
+int UartIrq( void )
+{
+	return !( Identify() & IIR_NONE );
+}
+
+uint32_t UartLoad( uint32_t reg )
+{
+	switch( reg )
+	{
+		case 0: return lcr & LCR_DLAB ? dll : (uint8_t)UartRxPop();
+		case 1: return lcr & LCR_DLAB ? dlm : ier;
+		case 2:
+		{
+			uint32_t iir = Identify();
+			if( ( iir & 0x0f ) == IIR_THRE ) thre_pending = 0;
+			return iir;
+		}
+		case 3: return lcr;
+		case 4: return mcr;
+		case 5: return ( rx_count ? LSR_DR : 0 ) | LSR_THRE | LSR_TEMT;
+		case 6:
+			// # 环回时调制解调器状态来自 MCR (DTR->DSR, RTS->CTS, OUT1->RI, OUT2->DCD), 否则 DCD, DSR, CTS 都有效
+			if( mcr & MCR_LOOP )
+				return ( ( mcr & 1 ) << 5 ) | ( ( mcr & 2 ) << 3 ) | ( ( mcr & 4 ) << 4 ) | ( ( mcr & 8 ) << 4 );
+			return 0xb0;
+		default: return scr;
+	}
+}
+
+int UartStore( uint32_t reg, uint32_t val )
+{
+	// # 逐字节输出走这里: 发送立即完成, THR 又空了; 没开 THRE 中断时电平不变
+	if( reg == 0 && !( ( lcr & LCR_DLAB ) | ( mcr & MCR_LOOP ) ) )
+	{
+		ConsolePut( val );
+		thre_pending = 1;
+		return ier & IER_ETBEI;
+	}
+	switch( reg )
+	{
+		case 0:
+			if( lcr & LCR_DLAB )
+				dll = val;
+			else
+			{
+				UartRxPush( val );	// # 环回
+				thre_pending = 1;
+			}
+			break;
+		case 1:
+			if( lcr & LCR_DLAB )
+				dlm = val;
+			else
+			{
+				if( ( val & IER_ETBEI ) && !( ier & IER_ETBEI ) ) thre_pending = 1;
+				ier = val & 0x0f;
+			}
+			break;
+		case 2:
+			// # 真的 16550 开关 FIFO 时也会清空它; 这里只在要求清的时候清, 开机时先到的那个字节不丢
+			if( val & FCR_CLEAR_RX ) rx_head = rx_count = 0;
+			fcr = val & ( FCR_ENABLE | 0xc0 );
+			break;
+		case 3: lcr = val; break;
+		case 4: mcr = val & 0x1f; break;
+		case 7: scr = val; break;
+	}
+	return 1;
+}
@@ -0,0 +1,42 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef UART16550_H
+#define UART16550_H
+
+#include <stdint.h>
+
+// # 16550A 串口: 16 字节的 RX FIFO, IER / IIR / FCR / LCR / MCR / LSR / MSR / SCR 和除数锁存器.
+// # 发送直接交给 console 的环形缓冲区 (它就是更深的 TX FIFO, 由写线程排空), 所以 THR 写完立即又空, THRE / TEMT 总是 1;
+// # 开了 THRE 中断时每次写 THR (以及 ETBEI 从 0 变 1) 都会再挂起一次, guest 每次中断填满 16 字节.
+// # 接收由 shell 把主机输入搬进 FIFO (UartRxPush); 数据量到了 FCR 设的触发深度报 "数据可用", 不到就报 "字符超时"
+// # (搬的时候主机那边已经没有更多了, 相当于线路上安静了 4 个字符时间).
+// # 中断线电平由 UartIrq 给出, shell 把它接到 PLIC.
+
+#define UART_BASE		0x10000000
+#define UART_FIFO		16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	void UartReset( void );
+	// # guest 读写寄存器 reg (0..7). 读 RBR 会取走一个字节, 读 IIR 会清掉报出的 THRE 中断.
+	// # UartStore 返回 0 表示中断线电平肯定没变
+	uint32_t UartLoad( uint32_t reg );
+	int UartStore( uint32_t reg, uint32_t val );
+	// # RX FIFO 里有多少字节 / 还能放多少
+	int UartRxCount( void );
+	int UartRxRoom( void );
+	void UartRxPush( uint8_t c );
+	// # 不经过寄存器直接取一个字节 (CSR 0x140 的调试输入用), 空时为 -1
+	int UartRxPop( void );
+	// # 中断线电平
+	int UartIrq( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //UART16550_H
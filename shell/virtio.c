@@ -0,0 +1,277 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#include "virtio.h"
+#include "plic.h"
+#include "core.h"
+
+#include <string.h>
+
+#define VIRTIO_MAGIC		0x74726976	// # "virt"
+#define VIRTIO_VENDOR		0x554d4551	// # "QEMU", 驱动不看它
+
+static uint8_t * ram;
+static uint32_t ram_size;
+
+void VirtioAttachRam( uint8_t * image, uint32_t size )
+{
+	ram = image;
+	ram_size = size;
+}
+
+// # guest 物理地址 [pa, pa + len) 在主机里的位置, 不全在 RAM 里时为 0
+static uint8_t * GuestPtr( uint64_t pa, uint64_t len )
+{
+	uint64_t ofs = pa - MINIRV32_RAM_IMAGE_OFFSET;
+	if( pa < MINIRV32_RAM_IMAGE_OFFSET || ofs > ram_size || ram_size - ofs < len ) return 0;
+	return ram + ofs;
+}
+
+static uint16_t Get16( uint64_t pa )
+{
+	uint8_t * p = GuestPtr( pa, 2 );
+	uint16_t v = 0;
+	if( p ) memcpy( &v, p, 2 );
+	return v;
+}
+
+static void Put16( uint64_t pa, uint16_t v )
+{
+	uint8_t * p = GuestPtr( pa, 2 );
+	if( p ) memcpy( p, &v, 2 );
+}
+
+static void Put32( uint64_t pa, uint32_t v )
+{
+	uint8_t * p = GuestPtr( pa, 4 );
+	if( p ) memcpy( p, &v, 4 );
+}
+
+void VirtioReset( struct VirtioDev * dev )
+{
+	dev->driver_features = 0;
+	dev->device_features_sel = dev->driver_features_sel = 0;
+	dev->queue_sel = 0;
+	dev->status = 0;
+	dev->isr = 0;
+	memset( dev->queue, 0, sizeof( dev->queue ) );
+	if( dev->irq ) PlicSetLevel( dev->irq, 0 );
+	if( dev->reset ) dev->reset( dev );
+}
+
+uint32_t VirtioLoad( void * ctx, uint32_t ofs )
+{
+	struct VirtioDev * dev = (struct VirtioDev *)ctx;
+	struct VirtQueue * q = dev->queue_sel < VIRTIO_QUEUES ? &dev->queue[dev->queue_sel] : 0;
+	uint64_t features = dev->features | 1ull << VIRTIO_F_VERSION_1;
+	if( ofs >= 0x100 )
+	{
+		// # 配置空间: 驱动按字段大小读, 这里总是给出从 ofs 起的 4 个字节, lb / lh 取低位
+		ofs -= 0x100;
+		if( !dev->config_load || ofs >= dev->config_size ) return 0;
+		return dev->config_load( dev, ofs & ~3 ) >> ( ( ofs & 3 ) * 8 );
+	}
+	switch( ofs )
+	{
+		case 0x000: return VIRTIO_MAGIC;
+		case 0x004: return 2;
+		case 0x008: return dev->device_id;
+		case 0x00c: return VIRTIO_VENDOR;
+		case 0x010: return dev->device_features_sel < 2 ? (uint32_t)( features >> ( 32 * dev->device_features_sel ) ) : 0;
+		case 0x034: return q ? VIRTIO_QUEUE_MAX : 0;
+		case 0x044: return q ? q->ready : 0;
+		case 0x060: return dev->isr;
+		case 0x070: return dev->status;
+		case 0x0fc: return 0;	// # ConfigGeneration: 配置空间不会自己变
+		default: return 0;
+	}
+}
+
+uint32_t VirtioStore( void * ctx, uint32_t ofs, uint32_t val )
+{
+	struct VirtioDev * dev = (struct VirtioDev *)ctx;
+	struct VirtQueue * q = dev->queue_sel < VIRTIO_QUEUES ? &dev->queue[dev->queue_sel] : 0;
+	if( ofs >= 0x100 )
+	{
+		if( dev->config_store && ofs - 0x100 < dev->config_size ) dev->config_store( dev, ( ofs - 0x100 ) & ~3, val );
+		return 0;
+	}
+	switch( ofs )
+	{
+		case 0x014: dev->device_features_sel = val; break;
+		case 0x020:
+			if( dev->driver_features_sel < 2 )
+			{
+				int shift = 32 * dev->driver_features_sel;
+				dev->driver_features = ( dev->driver_features & ~( 0xffffffffull << shift ) ) | (uint64_t)val << shift;
+			}
+			break;
+		case 0x024: dev->driver_features_sel = val; break;
+		case 0x030: dev->queue_sel = val; break;
+		case 0x038: if( q && val <= VIRTIO_QUEUE_MAX && !( val & ( val - 1 ) ) ) q->num = val; break;
+		case 0x044: if( q ) q->ready = val & 1; break;
+		case 0x050: if( val < VIRTIO_QUEUES && dev->queue[val].ready && dev->notify ) dev->notify( dev, val ); break;
+		case 0x064:
+			dev->isr &= ~val;
+			if( !dev->isr && dev->irq ) PlicSetLevel( dev->irq, 0 );
+			break;
+		case 0x070:
+			if( val == 0 ) VirtioReset( dev );
+			else dev->status = val;
+			break;
+		case 0x080: if( q ) q->desc = ( q->desc & ~0xffffffffull ) | val; break;
+		case 0x084: if( q ) q->desc = ( q->desc & 0xffffffff ) | (uint64_t)val << 32; break;
+		case 0x090: if( q ) q->avail = ( q->avail & ~0xffffffffull ) | val; break;
+		case 0x094: if( q ) q->avail = ( q->avail & 0xffffffff ) | (uint64_t)val << 32; break;
+		case 0x0a0: if( q ) q->used = ( q->used & ~0xffffffffull ) | val; break;
+		case 0x0a4: if( q ) q->used = ( q->used & 0xffffffff ) | (uint64_t)val << 32; break;
+	}
+	return 0;
+}
+
+int VirtqPop( struct VirtioDev * dev, int qn, struct VirtqChain * chain )
+{
+	struct VirtQueue * q = &dev->queue[qn];
+	if( !q->ready || !q->num ) return 0;
+	uint16_t avail_idx = Get16( q->avail + 2 );
+	if( q->last_avail == avail_idx ) return 0;
+	uint16_t head = Get16( q->avail + 4 + 2 * ( q->last_avail % q->num ) );
+	q->last_avail++;
+
+	chain->head = head;
+	chain->nread = chain->nwrite = 0;
+	chain->read_len = chain->write_len = 0;
+	uint16_t i = head;
+	for( int n = 0; ; n++ )
+	{
+		// # 描述符: addr u64, len u32, flags u16, next u16
+		uint8_t * d = GuestPtr( q->desc + 16ull * i, 16 );
+		if( i >= q->num || !d || n == VIRTQ_SEGS_MAX ) return -1;
+		uint64_t addr;
+		uint32_t len;
+		uint16_t flags, next;
+		memcpy( &addr, d, 8 );
+		memcpy( &len, d + 8, 4 );
+		memcpy( &flags, d + 12, 2 );
+		memcpy( &next, d + 14, 2 );
+		uint8_t * p = GuestPtr( addr, len );
+		if( !p ) return -1;
+		int k = chain->nread + chain->nwrite;
+		chain->seg[k].p = p;
+		chain->seg[k].len = len;
+		chain->seg[k].ofs = addr - MINIRV32_RAM_IMAGE_OFFSET;
+		if( flags & VIRTQ_DESC_F_WRITE )
+		{
+			chain->nwrite++;
+			chain->write_len += len;
+		}
+		else
+		{
+			if( chain->nwrite ) return -1;	// # 可读段必须都在可写段之前
+			chain->nread++;
+			chain->read_len += len;
+		}
+		if( !( flags & VIRTQ_DESC_F_NEXT ) ) return 1;
+		i = next;
+	}
+}
+
+void VirtqUnpop( struct VirtioDev * dev, int qn, int n )
+{
+	dev->queue[qn].last_avail -= n;
+}
+
+void VirtqPush( struct VirtioDev * dev, int qn, uint16_t head, uint32_t len )
+{
+	struct VirtQueue * q = &dev->queue[qn];
+	uint64_t elem = q->used + 4 + 8ull * ( q->used_idx % q->num );
+	Put32( elem, head );
+	Put32( elem + 4, len );
+	Put16( q->used + 2, ++q->used_idx );
+}
+
+void VirtioInterrupt( struct VirtioDev * dev, int qn )
+{
+	if( Get16( dev->queue[qn].avail ) & 1 ) return;	// # VIRTQ_AVAIL_F_NO_INTERRUPT
+	dev->isr |= 1;
+	dev->interrupts++;
+	if( dev->irq ) PlicSetLevel( dev->irq, 1 );
+}
+
+uint32_t VirtqRead( const struct VirtqChain * chain, uint32_t ofs, void * dst, uint32_t len )
+{
+	uint32_t done = 0;
+	for( int k = 0; k < chain->nread && done < len; k++ )
+	{
+		uint32_t l = chain->seg[k].len;
+		if( ofs >= l )
+		{
+			ofs -= l;
+			continue;
+		}
+		uint32_t n = l - ofs < len - done ? l - ofs : len - done;
+		memcpy( (uint8_t *)dst + done, chain->seg[k].p + ofs, n );
+		done += n;
+		ofs = 0;
+	}
+	return done;
+}
+
+uint32_t VirtqWrite( const struct VirtqChain * chain, uint32_t ofs, const void * src, uint32_t len )
+{
+	uint32_t done = 0;
+	for( int k = chain->nread; k < chain->nread + chain->nwrite && done < len; k++ )
+	{
+		uint32_t l = chain->seg[k].len;
+		if( ofs >= l )
+		{
+			ofs -= l;
+			continue;
+		}
+		uint32_t n = l - ofs < len - done ? l - ofs : len - done;
+		memcpy( chain->seg[k].p + ofs, (const uint8_t *)src + done, n );
+		MiniRV32IMAInvalidateDecoded( chain->seg[k].ofs + ofs, n );	// # 设备写了 RAM, 那里可能有解码过的代码
+		done += n;
+		ofs = 0;
+	}
+	return done;
+}
+
+int VirtqIov( const struct VirtqChain * chain, int write, uint32_t ofs, struct iovec * iov )
+{
+	int first = write ? chain->nread : 0;
+	int end = write ? chain->nread + chain->nwrite : chain->nread;
+	int n = 0;
+	for( int k = first; k < end; k++ )
+	{
+		uint32_t l = chain->seg[k].len;
+		if( ofs >= l )
+		{
+			ofs -= l;
+			continue;
+		}
+		iov[n].iov_base = chain->seg[k].p + ofs;
+		iov[n].iov_len = l - ofs;
+		n++;
+		ofs = 0;
+	}
+	return n;
+}
+
+void VirtqInvalidate( const struct VirtqChain * chain, uint32_t ofs, uint32_t len )
+{
+	for( int k = chain->nread; k < chain->nread + chain->nwrite && len; k++ )
+	{
+		uint32_t l = chain->seg[k].len;
+		if( ofs >= l )
+		{
+			ofs -= l;
+			continue;
+		}
+		uint32_t n = l - ofs < len ? l - ofs : len;
+		MiniRV32IMAInvalidateDecoded( chain->seg[k].ofs + ofs, n );
+		len -= n;
+		ofs = 0;
+	}
+}
@@ -0,0 +1,103 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+// # virtio-mmio 传输层 (规范 1.x 的 version 2 寄存器布局) 和 split virtqueue. 具体设备 (块设备, 网卡) 填好 VirtioDev 的
+// # 设备号, 特性位和回调, 再把 VirtioLoad / VirtioStore 登记进 MMIO 设备表 (shell/mmio.h), 每个设备占一页.
+// # 设备号为 0 表示这个槽位空着 (规范里的占位设备), guest 的驱动探测到会跳过, DTB 里的节点可以一直留着.
+// # guest 只有一个 hart, 又和设备在同一个线程里, 读写环不需要内存屏障.
+// # 中断: 设备完成请求后 VirtioInterrupt 置 InterruptStatus 并拉高自己的 PLIC 线, guest 写 InterruptACK 清掉后放下;
+// # MEIP 由调用方 (shell) 在寄存器读写之后重新计算.
+
+#define VIRTIO_QUEUES		2			// # 每个设备最多几个队列 (网卡 rx / tx)
+#define VIRTIO_QUEUE_MAX	256			// # QueueNumMax
+
+#define VIRTIO_F_VERSION_1	32			// # 特性位的编号
+
+#define VIRTQ_DESC_F_NEXT	1
+#define VIRTQ_DESC_F_WRITE	2
+
+struct VirtQueue
+{
+	uint32_t num;
+	uint32_t ready;
+	uint64_t desc, avail, used;		// # guest 物理地址
+	uint16_t last_avail;			// # 下一个要取的 avail ring 位置
+	uint16_t used_idx;
+};
+
+// # 一个描述符链在主机里的样子: 依次排好的段, 可读 (guest -> 设备) 的在前, 可写的在后
+#define VIRTQ_SEGS_MAX		128
+struct VirtqChain
+{
+	uint16_t head;
+	int nread, nwrite;
+	uint32_t read_len, write_len;	// # 各自的总字节数
+	struct { uint8_t * p; uint32_t len; uint32_t ofs; } seg[VIRTQ_SEGS_MAX];	// # ofs: 在 guest RAM 里的偏移, 用来让解码缓存失效
+};
+
+struct VirtioDev
+{
+	uint32_t device_id;
+	uint64_t features;				// # 设备提供的特性, VIRTIO_F_VERSION_1 会自动加上
+	int irq;						// # PLIC 中断号
+	uint32_t config_size;
+	// # 读写配置空间 (0x100 之后), ofs 相对配置空间起点, 按 4 字节对齐; 没有时读为 0
+	uint32_t (*config_load)( struct VirtioDev * dev, uint32_t ofs );
+	void (*config_store)( struct VirtioDev * dev, uint32_t ofs, uint32_t val );
+	// # guest 写了 QueueNotify
+	void (*notify)( struct VirtioDev * dev, int queue );
+	// # guest 写 Status = 0 (以及重启) 之后, 设备丢掉自己的状态
+	void (*reset)( struct VirtioDev * dev );
+	void * ctx;
+
+	// # 以下是传输层的状态
+	uint64_t driver_features;
+	uint32_t device_features_sel, driver_features_sel;
+	uint32_t queue_sel;
+	uint32_t status;
+	uint32_t isr;
+	struct VirtQueue queue[VIRTIO_QUEUES];
+	uint64_t interrupts;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// # guest RAM 在哪里, 分配好 RAM 之后调用一次
+	void VirtioAttachRam( uint8_t * ram, uint32_t size );
+	// # 寄存器读写, 签名和 MmioLoadFn / MmioStoreFn 一致, ctx 是 struct VirtioDev *
+	uint32_t VirtioLoad( void * ctx, uint32_t ofs );
+	uint32_t VirtioStore( void * ctx, uint32_t ofs, uint32_t val );
+	// # 复位传输层和设备 (重启时)
+	void VirtioReset( struct VirtioDev * dev );
+
+	// # 取出队列 q 里下一个可用的描述符链. 没有了返回 0, 取到返回 1; 链有问题 (越界, 成环, 太长) 返回 -1,
+	// # 这时 chain->head 仍然有效, 调用方应当把它以长度 0 放回
+	int VirtqPop( struct VirtioDev * dev, int q, struct VirtqChain * chain );
+	// # 把最后取出的 n 个链退回 avail ring (设备这次处理不了, 比如对端收不下), 下次 VirtqPop 按原来的顺序再取到
+	void VirtqUnpop( struct VirtioDev * dev, int q, int n );
+	// # 把处理完的链放进 used ring, len 为写进可写段的字节数
+	void VirtqPush( struct VirtioDev * dev, int q, uint16_t head, uint32_t len );
+	// # 一批 VirtqPush 之后调用: guest 没有关掉通知时发中断
+	void VirtioInterrupt( struct VirtioDev * dev, int q );
+	// # 在链的可读段里从 ofs 起拷 len 字节到 dst / 从 src 拷到可写段的 ofs 起; 返回实际拷了多少
+	uint32_t VirtqRead( const struct VirtqChain * chain, uint32_t ofs, void * dst, uint32_t len );
+	uint32_t VirtqWrite( const struct VirtqChain * chain, uint32_t ofs, const void * src, uint32_t len );
+	// # 可读段 (write = 0) 或可写段 (write = 1) 跳过开头 ofs 字节之后的部分, 列成 iovec 直接交给系统调用; 返回个数
+	int VirtqIov( const struct VirtqChain * chain, int write, uint32_t ofs, struct iovec * iov );
+	// # 不经过 VirtqWrite 写了可写段 (比如 recvmsg 直接收进 guest RAM) 之后调用, 让那里解码过的代码失效
+	void VirtqInvalidate( const struct VirtqChain * chain, uint32_t ofs, uint32_t len );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //VIRTIO_H
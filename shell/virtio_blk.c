@@ -0,0 +1,175 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#include "virtio_blk.h"
+#include "plic.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define VIRTIO_ID_BLOCK			2
+#define VIRTIO_BLK_F_SEG_MAX	2
+#define VIRTIO_BLK_F_RO			5
+#define VIRTIO_BLK_F_FLUSH		9
+
+#define VIRTIO_BLK_T_IN			0
+#define VIRTIO_BLK_T_OUT		1
+#define VIRTIO_BLK_T_FLUSH		4
+#define VIRTIO_BLK_T_GET_ID		8
+
+#define VIRTIO_BLK_S_OK			0
+#define VIRTIO_BLK_S_IOERR		1
+#define VIRTIO_BLK_S_UNSUPP		2
+
+#define SECTOR	512
+
+static struct VirtioDev blk;
+static uint8_t * disk;
+static uint64_t disk_size;
+static int disk_shared;		// # MAP_SHARED: 写进镜像文件, FLUSH 时 msync
+static int disk_ro;
+static const char * disk_id;
+
+static uint64_t reads, writes, flushes, read_bytes, write_bytes;
+
+static uint32_t Request( const struct VirtqChain * c )
+{
+	struct { uint32_t type, reserved; uint64_t sector; } hdr;
+	if( VirtqRead( c, 0, &hdr, sizeof( hdr ) ) != sizeof( hdr ) || c->write_len < 1 ) return 0;
+
+	// # 状态是最后一个可写字节, 读请求的数据是它前面的可写部分, 写请求的数据是请求头后面的可读部分
+	uint32_t in_len = c->write_len - 1;
+	uint32_t out_len = c->read_len - sizeof( hdr );
+	uint64_t pos = hdr.sector * SECTOR;
+	uint8_t status = VIRTIO_BLK_S_OK;
+	uint32_t written = 0;
+	int in_range = hdr.sector <= disk_size / SECTOR;
+	switch( hdr.type )
+	{
+		case VIRTIO_BLK_T_IN:
+			if( !in_range || disk_size - pos < in_len )
+			{
+				status = VIRTIO_BLK_S_IOERR;
+				break;
+			}
+			written = VirtqWrite( c, 0, disk + pos, in_len );
+			reads++;
+			read_bytes += in_len;
+			break;
+		case VIRTIO_BLK_T_OUT:
+			if( disk_ro || !in_range || disk_size - pos < out_len )
+			{
+				status = VIRTIO_BLK_S_IOERR;
+				break;
+			}
+			VirtqRead( c, sizeof( hdr ), disk + pos, out_len );
+			writes++;
+			write_bytes += out_len;
+			break;
+		case VIRTIO_BLK_T_FLUSH:
+			if( disk_shared && msync( disk, disk_size, MS_SYNC ) ) status = VIRTIO_BLK_S_IOERR;
+			flushes++;
+			break;
+		case VIRTIO_BLK_T_GET_ID:
+		{
+			// # 20 字节, 不满时以 0 结尾
+			char id[20] = { 0 };
+			size_t n = strlen( disk_id );
+			memcpy( id, disk_id, n < sizeof( id ) ? n : sizeof( id ) );
+			written = VirtqWrite( c, 0, id, in_len < sizeof( id ) ? in_len : sizeof( id ) );
+			break;
+		}
+		default:
+			status = VIRTIO_BLK_S_UNSUPP;
+			break;
+	}
+	VirtqWrite( c, c->write_len - 1, &status, 1 );
+	return written + 1;
+}
+
+static void Notify( struct VirtioDev * dev, int q )
+{
+	static struct VirtqChain c;
+	int r, done = 0;
+	while( ( r = VirtqPop( dev, q, &c ) ) != 0 )
+	{
+		VirtqPush( dev, q, c.head, r > 0 ? Request( &c ) : 0 );
+		done = 1;
+	}
+	if( done ) VirtioInterrupt( dev, q );
+}
+
+// # 配置空间: capacity (u64, 扇区数), size_max, seg_max
+static uint32_t ConfigLoad( struct VirtioDev * dev, uint32_t ofs )
+{
+	uint64_t capacity = disk_size / SECTOR;
+	switch( ofs )
+	{
+		case 0: return (uint32_t)capacity;
+		case 4: return (uint32_t)( capacity >> 32 );
+		case 12: return VIRTQ_SEGS_MAX - 2;	// # 请求头和状态各占一段
+		default: return 0;
+	}
+}
+
+struct VirtioDev * VirtioBlkInit( const char * path, int overlay )
+{
+	blk.irq = PLIC_IRQ_BLK;
+	if( !path ) return &blk;
+
+	int fd = open( path, overlay ? O_RDONLY : O_RDWR );
+	if( fd < 0 && !overlay && ( errno == EACCES || errno == EROFS ) )
+	{
+		fd = open( path, O_RDONLY );
+		disk_ro = 1;
+	}
+	struct stat st;
+	if( fd < 0 || fstat( fd, &st ) )
+	{
+		fprintf( stderr, "Error: could not open disk image \"%s\": %s\n", path, strerror( errno ) );
+		return 0;
+	}
+	disk_size = st.st_size;
+	if( disk_size < SECTOR )
+	{
+		fprintf( stderr, "Error: disk image \"%s\" is smaller than one sector\n", path );
+		close( fd );
+		return 0;
+	}
+	disk_shared = !overlay && !disk_ro;
+	disk = mmap( 0, disk_size, PROT_READ | ( disk_ro ? 0 : PROT_WRITE ), overlay ? MAP_PRIVATE : MAP_SHARED, fd, 0 );
+	close( fd );
+	if( disk == MAP_FAILED )
+	{
+		fprintf( stderr, "Error: could not map disk image \"%s\": %s\n", path, strerror( errno ) );
+		disk = 0;
+		return 0;
+	}
+	if( disk_ro )
+		fprintf( stderr, "Warning: disk image \"%s\" is not writable, attaching it read-only.\n", path );
+	const char * slash = strrchr( path, '/' );
+	disk_id = slash ? slash + 1 : path;
+
+	blk.device_id = VIRTIO_ID_BLOCK;
+	blk.features = 1ull << VIRTIO_BLK_F_SEG_MAX | 1ull << VIRTIO_BLK_F_FLUSH | (uint64_t)disk_ro << VIRTIO_BLK_F_RO;
+	blk.config_size = 24;
+	blk.config_load = ConfigLoad;
+	blk.notify = Notify;
+	return &blk;
+}
+
+void VirtioBlkReport( void )
+{
+	if( !disk ) return;
+	fprintf( stderr, "virtio-blk: %llu MiB%s, %llu reads (%llu MiB), %llu writes (%llu MiB), %llu flushes, %llu interrupts\n",
+		(unsigned long long)( disk_size >> 20 ), disk_shared ? "" : disk_ro ? " read-only" : " overlay",
+		(unsigned long long)reads, (unsigned long long)( read_bytes >> 20 ),
+		(unsigned long long)writes, (unsigned long long)( write_bytes >> 20 ),
+		(unsigned long long)flushes, (unsigned long long)blk.interrupts );
+}
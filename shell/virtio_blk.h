@@ -0,0 +1,30 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include "virtio.h"
+
+// # virtio 块设备, 后端是 mmap 进来的磁盘镜像: 读写请求直接在 guest RAM 和映射之间 memcpy, 没有系统调用,
+// # 页缓存没命中时由缺页去读盘. 每次 QueueNotify 把 avail ring 里的请求全部做完 (最多 VIRTIO_QUEUE_MAX 个同时在队列里),
+// # 再发一次中断.
+// # overlay 模式: 镜像只读打开, MAP_PRIVATE 映射, guest 的写入落在进程自己的页里 (写时复制), 退出就丢掉, 镜像不变.
+// # 镜像本身只读 (没有写权限) 时设备报告 VIRTIO_BLK_F_RO.
+
+#define VIRTIO_BLK_BASE	0x10001000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// # path 为 0 时设备号为 0 (空槽位). 打不开或映射失败时打印原因, 返回 0
+	struct VirtioDev * VirtioBlkInit( const char * path, int overlay );
+	void VirtioBlkReport( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //VIRTIO_BLK_H
@@ -0,0 +1,302 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#define _GNU_SOURCE	// # sendmmsg / recvmmsg
+#include "virtio_net.h"
+#include "plic.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define VIRTIO_ID_NET		1
+#define VIRTIO_NET_F_MTU	3
+#define VIRTIO_NET_F_MAC	5
+
+#define NET_RXQ		0
+#define NET_TXQ		1
+#define NET_HDR		12			// # virtio_net_hdr_v1: flags, gso_type, hdr_len, gso_size, csum_start, csum_offset, num_buffers
+#define NET_MTU		65520		// # 加上 14 字节的以太网头不超过 64KiB
+#define NET_BATCH	64			// # 一次 sendmmsg / recvmmsg 最多几个包
+#define NET_SOCKBUF	( 4 << 20 )	// # 请求的 socket 缓冲区, 实际受 net.core.wmem_max / rmem_max 限制
+
+static struct VirtioDev net;
+static const char * net_spec;
+static int sock = -1;
+static struct sockaddr_un self, peer;
+static int path_mode;		// # "path:peer": 自己绑了文件, 退出时删掉; 对端重启过要重新 connect
+static int linked;			// # 已经 connect 到对端
+static int tx_backlog;		// # 对端收不下, tx 队列里还有包
+static uint8_t mac[6];
+
+static uint64_t rx_packets, rx_bytes, rx_dropped, tx_packets, tx_bytes, tx_dropped;
+
+// # 数据报 socket 连上对端之后, 对端往这边发不受 net.unix.max_dgram_qlen (默认 10 个) 的限制, 只受发送缓冲区限制
+static int Link( void )
+{
+	if( path_mode && !linked )
+		linked = connect( sock, (struct sockaddr *)&peer, sizeof( peer ) ) == 0;
+	return linked;
+}
+
+// # 发一批, 返回从队列里消耗掉 (发出去或者丢掉) 的个数; 对端收不下时比 n 少
+static int Send( struct mmsghdr * msg, int n )
+{
+	if( !Link() )
+	{
+		// # 对端还没起来: 相当于网线没插, 全部丢掉
+		tx_dropped += n;
+		return n;
+	}
+	int k = sendmmsg( sock, msg, n, MSG_DONTWAIT );
+	if( k > 0 )
+	{
+		for( int i = 0; i < k; i++ ) tx_bytes += msg[i].msg_len;
+		tx_packets += k;
+		return k;
+	}
+	if( errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ) return 0;
+	if( errno == ECONNREFUSED || errno == ENOTCONN )
+	{
+		// # 对端退出了: 这一批丢掉, 下次发的时候重新连 (它可能已经重启)
+		linked = 0;
+		tx_dropped += n;
+		return n;
+	}
+	// # 其他错误 (比如帧比 socket 缓冲区还大) 只丢第一个
+	tx_dropped++;
+	return 1;
+}
+
+static void Tx( void )
+{
+	static struct VirtqChain c[NET_BATCH];
+	static struct iovec iov[NET_BATCH][VIRTQ_SEGS_MAX];
+	static struct mmsghdr msg[NET_BATCH];
+	int done = 0;
+	tx_backlog = 0;
+	for( ;; )
+	{
+		int n = 0, r;
+		while( n < NET_BATCH && ( r = VirtqPop( &net, NET_TXQ, &c[n] ) ) != 0 )
+		{
+			if( r < 0 || c[n].read_len <= NET_HDR )
+			{
+				// # 坏链直接还回去; 前面已经攒了几个的话先把它们发掉, 发不完时退回的就只是最后那几个
+				if( n )
+				{
+					VirtqUnpop( &net, NET_TXQ, 1 );
+					break;
+				}
+				VirtqPush( &net, NET_TXQ, c[n].head, 0 );
+				tx_dropped++;
+				done = 1;
+				continue;
+			}
+			memset( &msg[n].msg_hdr, 0, sizeof( msg[n].msg_hdr ) );
+			msg[n].msg_hdr.msg_iov = iov[n];
+			msg[n].msg_hdr.msg_iovlen = VirtqIov( &c[n], 0, NET_HDR, iov[n] );
+			n++;
+		}
+		if( !n ) break;
+		int k = Send( msg, n );
+		for( int i = 0; i < k; i++ )
+			VirtqPush( &net, NET_TXQ, c[i].head, 0 );
+		if( k ) done = 1;
+		if( k < n )
+		{
+			VirtqUnpop( &net, NET_TXQ, n - k );
+			tx_backlog = 1;
+			break;
+		}
+	}
+	if( done ) VirtioInterrupt( &net, NET_TXQ );
+}
+
+// # 收到 socket 空了或者接收缓冲区用完为止; 返回 1 表示停在 socket 空了 (缓冲区还有)
+static int Rx( void )
+{
+	static struct VirtqChain c[NET_BATCH];
+	static struct iovec iov[NET_BATCH][VIRTQ_SEGS_MAX];
+	static struct mmsghdr msg[NET_BATCH];
+	static const uint8_t hdr[NET_HDR] = { [10] = 1 };	// # num_buffers = 1, 其余为 0: 校验和已经算好, 没有 GSO
+	int done = 0, room = 0;
+	for( ;; )
+	{
+		int n = 0, r;
+		while( n < NET_BATCH && ( r = VirtqPop( &net, NET_RXQ, &c[n] ) ) != 0 )
+		{
+			if( r < 0 || c[n].write_len <= NET_HDR )
+			{
+				if( n )
+				{
+					VirtqUnpop( &net, NET_RXQ, 1 );
+					break;
+				}
+				VirtqPush( &net, NET_RXQ, c[n].head, 0 );
+				done = 1;
+				continue;
+			}
+			memset( &msg[n].msg_hdr, 0, sizeof( msg[n].msg_hdr ) );
+			msg[n].msg_hdr.msg_iov = iov[n];
+			msg[n].msg_hdr.msg_iovlen = VirtqIov( &c[n], 1, NET_HDR, iov[n] );
+			n++;
+		}
+		if( !n ) break;
+		int k = recvmmsg( sock, msg, n, MSG_DONTWAIT, 0 );
+		if( k < 0 ) k = 0;
+		for( int i = 0; i < k; i++ )
+		{
+			uint32_t len = msg[i].msg_len;
+			if( msg[i].msg_hdr.msg_flags & MSG_TRUNC )
+			{
+				// # 比这个缓冲区大 (guest 没有协商 MTU 而对端发了大帧): 丢掉, 缓冲区以长度 0 还回去
+				VirtqPush( &net, NET_RXQ, c[i].head, 0 );
+				rx_dropped++;
+				continue;
+			}
+			VirtqWrite( &c[i], 0, hdr, NET_HDR );
+			VirtqInvalidate( &c[i], NET_HDR, len );
+			VirtqPush( &net, NET_RXQ, c[i].head, NET_HDR + len );
+			rx_packets++;
+			rx_bytes += len;
+		}
+		if( k ) done = 1;
+		if( k < n )
+		{
+			VirtqUnpop( &net, NET_RXQ, n - k );
+			room = 1;
+			break;
+		}
+	}
+	if( done )
+	{
+		VirtioInterrupt( &net, NET_RXQ );
+		Link();	// # 对端先连过来了, 这边也连上它
+	}
+	return room;
+}
+
+// # rx 队列的通知 (guest 补了接收缓冲区) 由 shell 安排一次轮询
+static void Notify( struct VirtioDev * dev, int q )
+{
+	if( q == NET_TXQ ) Tx();
+}
+
+static void Reset( struct VirtioDev * dev )
+{
+	tx_backlog = 0;
+}
+
+// # 配置空间: mac[6], status (u16, 没有提供 VIRTIO_NET_F_STATUS, 驱动不看), max_virtqueue_pairs, mtu
+static uint32_t ConfigLoad( struct VirtioDev * dev, uint32_t ofs )
+{
+	switch( ofs )
+	{
+		case 0: return mac[0] | mac[1] << 8 | mac[2] << 16 | (uint32_t)mac[3] << 24;
+		case 4: return mac[4] | mac[5] << 8;
+		case 8: return 1 | NET_MTU << 16;
+		default: return 0;
+	}
+}
+
+static void Unbind( void )
+{
+	unlink( self.sun_path );
+}
+
+int VirtioNetPoll( int * fd )
+{
+	*fd = sock;
+	if( sock < 0 ) return VIRTIO_NET_STOP;
+	if( tx_backlog ) Tx();
+	int room = Rx();
+	return tx_backlog ? VIRTIO_NET_WRITE : room ? VIRTIO_NET_READ : VIRTIO_NET_STOP;
+}
+
+struct VirtioDev * VirtioNetInit( const char * spec )
+{
+	net.irq = PLIC_IRQ_NET;
+	if( !spec ) return &net;
+
+	uint32_t hash = 2166136261u;	// # FNV-1a, MAC 地址的后三个字节
+	if( !strncmp( spec, "fd:", 3 ) )
+	{
+		char * end;
+		long fd = strtol( spec + 3, &end, 10 );
+		int type = 0;
+		socklen_t type_len = sizeof( type );
+		if( end == spec + 3 || *end || fd < 0 || getsockopt( fd, SOL_SOCKET, SO_TYPE, &type, &type_len ) || type != SOCK_DGRAM )
+		{
+			fprintf( stderr, "Error: -N %s is not an open datagram socket\n", spec );
+			return 0;
+		}
+		sock = fd;
+		fcntl( sock, F_SETFL, fcntl( sock, F_GETFL ) | O_NONBLOCK );
+		linked = 1;
+		// # 同一个脚本起的几台机器只有 pid 不同
+		pid_t pid = getpid();
+		for( int i = 0; i < 4; i++ ) hash = ( hash ^ ( pid >> ( 8 * i ) & 0xff ) ) * 16777619;
+	}
+	else
+	{
+		const char * sep = strchr( spec, ':' );
+		if( !sep || sep == spec || !sep[1] || sep - spec >= sizeof( self.sun_path ) || strlen( sep + 1 ) >= sizeof( peer.sun_path ) )
+		{
+			fprintf( stderr, "Error: -N expects \"path:peer\" or \"fd:N\", got \"%s\"\n", spec );
+			return 0;
+		}
+		self.sun_family = peer.sun_family = AF_UNIX;
+		memcpy( self.sun_path, spec, sep - spec );
+		memcpy( peer.sun_path, sep + 1, strlen( sep + 1 ) );
+		sock = socket( AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+		// # 上次留下的 socket 文件先删掉再绑, 不是 socket 的文件不动
+		struct stat st;
+		if( !lstat( self.sun_path, &st ) && S_ISSOCK( st.st_mode ) ) unlink( self.sun_path );
+		if( sock < 0 || bind( sock, (struct sockaddr *)&self, sizeof( self ) ) )
+		{
+			fprintf( stderr, "Error: could not bind \"%s\": %s\n", self.sun_path, strerror( errno ) );
+			return 0;
+		}
+		atexit( Unbind );
+		path_mode = 1;
+		Link();
+		for( const char * p = self.sun_path; *p; p++ ) hash = ( hash ^ (uint8_t)*p ) * 16777619;
+	}
+	int size = NET_SOCKBUF;
+	setsockopt( sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof( size ) );
+	setsockopt( sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof( size ) );
+	net_spec = spec;
+
+	// # 52:54:00 开头, 本地管理的单播地址
+	mac[0] = 0x52;
+	mac[1] = 0x54;
+	mac[2] = 0x00;
+	mac[3] = hash >> 16;
+	mac[4] = hash >> 8;
+	mac[5] = hash;
+
+	net.device_id = VIRTIO_ID_NET;
+	net.features = 1ull << VIRTIO_NET_F_MTU | 1ull << VIRTIO_NET_F_MAC;
+	net.config_size = 12;
+	net.config_load = ConfigLoad;
+	net.notify = Notify;
+	net.reset = Reset;
+	return &net;
+}
+
+void VirtioNetReport( void )
+{
+	if( sock < 0 ) return;
+	fprintf( stderr, "virtio-net: %s, %llu packets in (%llu MiB), %llu out (%llu MiB), %llu dropped in, %llu dropped out, %llu interrupts\n",
+		net_spec, (unsigned long long)rx_packets, (unsigned long long)( rx_bytes >> 20 ),
+		(unsigned long long)tx_packets, (unsigned long long)( tx_bytes >> 20 ),
+		(unsigned long long)rx_dropped, (unsigned long long)tx_dropped, (unsigned long long)net.interrupts );
+}
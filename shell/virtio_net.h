@@ -0,0 +1,41 @@
+//
+// Created by liujilan on 25-10-20.
+//
+
+#ifndef VIRTIO_NET_H
+#define VIRTIO_NET_H
+
+#include "virtio.h"
+
+// # virtio 网卡, 后端是一个 Unix 数据报 socket: 一个数据报就是一个以太网帧 (不带 virtio_net_hdr), 不需要 tap 设备和主机网络权限.
+// # 两种接法:
+// #   "path:peer"  绑定到 path, 和对端绑定的 peer 连起来 (两个模拟器互相指向对方), 先起来的那个发的包在对端起来之前丢掉;
+// #   "fd:N"       用继承来的、已经连好的数据报 socket, 比如启动脚本用 socketpair 建的一对, 或者一个转发进程给的.
+// # 多台机器要组网时让它们都连到同一个转发 (交换) 进程上.
+// # 发送: guest 写 QueueNotify 时把 tx 队列里的包全部取出, 一次 sendmmsg 直接从 guest RAM 发出去 (每批 NET_BATCH 个);
+// # 对端收不下时剩下的留在队列里, 等 socket 可写了再发. 接收: shell 定期 (空闲时在 socket 可读时) 调用 VirtioNetPoll,
+// # 用 recvmmsg 直接收进 guest 给的接收缓冲区, 直到 socket 空了或者缓冲区用完. 每批只发一次中断.
+// # 提供 VIRTIO_NET_F_MTU, MTU 接近 64KiB (数据报的上限), 大块传输时每个包的开销摊得很薄.
+
+#define VIRTIO_NET_BASE	0x10002000
+
+// # VirtioNetPoll 的结果
+#define VIRTIO_NET_STOP		0	// # 没有接收缓冲区, 也没有积压的包: 不用再轮询, 等 guest 通知
+#define VIRTIO_NET_READ		1	// # 等 socket 可读
+#define VIRTIO_NET_WRITE	2	// # 有包在等对端腾地方: 等 socket 可写
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// # spec 为 0 时设备号为 0 (空槽位). 格式不对或者 socket 建不起来时打印原因, 返回 0
+	struct VirtioDev * VirtioNetInit( const char * spec );
+	// # 收包, 重发积压的包. 返回接下来空闲时要等 socket (*fd) 的什么, 见下
+	int VirtioNetPoll( int * fd );
+	void VirtioNetReport( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //VIRTIO_NET_H
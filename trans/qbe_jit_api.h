@@ -21,9 +21,13 @@ namespace qbejit {
 namespace fs = std::filesystem;
 
 // 导出的 JIT 函数签名：与你的 SSA 约定一致
-// QBE: export function w $<name>(p %state, p %ram, w %pc_in)
-// C++: int (*JitFn)(void* state, void* ram, uint32_t pc_in)
-using JitFn = int(*)(void*, void*, uint32_t);
+// QBE: export function w $<name>(l %state, l %ram, w %pc_in, l %helper)
+// C++: int (*JitFn)(void* state, void* ram, uint32_t pc_in, JitHelperFn helper)
+// 返回值为块内实际执行的指令条数
+
+// 块内遇到翻译器不支持的指令时回调的解释器 helper: 执行单条指令, 0 = 已执行, 非 0 = 交回解释器
+using JitHelperFn = int(*)(void* state, void* ram, uint32_t pc, uint32_t ir);
+using JitFn = int(*)(void*, void*, uint32_t, JitHelperFn);
 
 // 生成进程唯一的“全局父目录”（首次调用用 mkdtemp 创建一次）
 inline const std::string& default_parent() {
@@ -22,19 +22,66 @@ struct MemMapV01 {
     }
 };
 
+// 块内的 guest 寄存器缓存在 QBE 临时变量 %xN 中:
+//   - 第一次读时才从 state->regs[N] 加载 (lazy load)
+//   - 写入后标记 dirty, 只在块出口 / helper 调用前写回
+// 不能翻译的指令不再结束整个块, 而是生成一次 helper 调用:
+//   写回 dirty 寄存器 -> call %helper(state, ram, pc, ir) -> 重新加载 rd -> 继续
+// helper 返回非 0 表示"这条指令要交给解释器"(陷入 / 有副作用的 MMIO 等), 此时块直接返回已执行条数.
+//
+// 导出函数签名:
+//   export function w $pc_XXXXXXXX(l %state, l %ram, w %pc_in, l %helper)
+//   返回值 = 本块实际执行(退休)的指令条数, 下一条 pc = pc_in + 4 * 返回值
 class Rv32iQbeTrans_v01 {
 public:
-    void init(const std::string& func_name) {
+    static constexpr int kMaxBlockLen = 64;     // 块长上限, 主要由控制流决定, 这里只是兜底
+
+    // code_pages: 宿主上按 4KiB guest 页索引的字节表, 非 0 的页上有已翻译的块; store 快路径写到这些页时改走 helper
+    void init(const std::string& func_name, uint32_t pc, uint32_t ram_size, const uint8_t* code_pages = nullptr) {
         reset();
         func_ = func_name;
+        pc_ = pc;
+        ramSize_ = ram_size;
+        codePages_ = code_pages;
         // 🔧 关键修正：函数头必须包含返回类型 w；指针参数用 l（64-bit）
-        ss_ << "export function w $" << func_ << "(l %state, l %ram, w %pc_in) {\n";
+        ss_ << "export function w $" << func_ << "(l %state, l %ram, w %pc_in, l %helper) {\n";
         ss_ << "@L0\n";
-        ss_ << "        %pc =w copy %pc_in\n";
     }
 
-    // 返回：若可翻译则给出片段（不含函数收尾）；不可翻译则 nullopt
-    std::optional<std::string> translateOne(uint32_t ir, bool allowMem) {
+    // 这条指令是否必须结束块(交回解释器处理):
+    // 跳转/分支, ECALL/EBREAK/MRET/WFI, 以及读 cycle 的 CSR(cycle 只在解释器局部变量里)
+    static bool endsBlock(uint32_t ir) {
+        const uint32_t opc = ir & 0x7F;
+        if (opc == 0x63 || opc == 0x6F || opc == 0x67) return true;
+        if (opc == 0x73) {
+            if (((ir >> 12) & 0x3) == 0) return true;      // SYSTEM (非 Zicsr)
+            if ((ir >> 20) == 0xC00) return true;           // cycle
+        }
+        return false;
+    }
+
+    // 翻译一条指令并追加到块中; 本地不支持的指令走 helper. 返回 false 表示块到此结束(该指令不计入块).
+    bool append(uint32_t ir) {
+        if (count_ >= kMaxBlockLen || endsBlock(ir)) return false;
+        const uint32_t pc = pc_ + 4u * count_;
+        if (!translateOne(ir, pc))
+            emitHelper(ir, pc);
+        count_++;
+        return true;
+    }
+
+    int length() const { return count_; }
+
+    std::string finalize() {
+        spillDirty(ss_, false);
+        ss_ << "        ret " << count_ << "\n";
+        ss_ << "}\n";
+        return ss_.str();
+    }
+
+private:
+    // 返回 false 表示本地不支持, 需要 helper; 返回 true 时代码已写入 ss_
+    bool translateOne(uint32_t ir, uint32_t pc) {
         const uint32_t opc   = ir & 0x7F;
         const int rd         = (ir >> 7)  & 0x1F;
         const int funct3     = (ir >> 12) & 0x7;
@@ -42,148 +89,236 @@ public:
         const int rs2        = (ir >> 20) & 0x1F;
         const int funct7     = (ir >> 25) & 0x7F;
 
-        // 读寄存器：x0 恒为 0；其它寄存器用 %xN
-        auto R = [&](int x) -> std::string {
-            if (x == 0) return "0";
-            return "%x" + std::to_string(x);
-        };
-        // 写寄存器：x0 写入丢弃，输出注释；否则生成 "%xN =w <expr>"
-        auto SET = [&](int rdd, const std::string& expr, std::ostringstream& out) {
-            if (rdd == 0) {
-                out << "        # x0 <- " << expr << " (ignored)\n";
-            } else {
-                out << "        %x" << rdd << " =w " << expr << "\n";
-            }
-        };
-
         auto immI  = [&](){ return (int32_t)ir >> 20; };
         auto immU  = [&](){ return (int32_t)(ir & 0xFFFFF000); };
         auto immS  = [&](){ int32_t v = (int32_t)(((ir >> 25) << 5) | ((ir >> 7) & 0x1F)); return (v << 20) >> 20; };
 
-        std::ostringstream out;
-
-        // 先把跳转/系统类指令交回解释器（v01 只做直线指令）
-        if (opc == 0x63 || opc == 0x6F || opc == 0x67 || opc == 0x73 || opc == 0x0F) {
-            return std::nullopt;
-        }
+        std::ostringstream& out = ss_;
 
         // ===== LUI =====
         if (opc == 0x37) {
-            SET(rd, std::to_string(immU()), out);
-            return out.str();
+            SET(rd, std::string("copy ") + std::to_string(immU()), out);
+            return true;
         }
 
-        // ===== AUIPC =====
+        // ===== AUIPC ===== (翻译时 pc 已知, 直接折叠成常量)
         if (opc == 0x17) {
-            // pc 已在寄存器 %pc 中，如需要可拓展：%t =w add %pc, immU ; SET(rd, %t)
-            // 这里 v01 先交回解释器；如需支持请自行拓展。
-            return std::nullopt;
+            SET(rd, std::string("copy ") + std::to_string((int32_t)(pc + (uint32_t)immU())), out);
+            return true;
+        }
+
+        // ===== FENCE ===== 本实现忽略 fence
+        if (opc == 0x0F) {
+            out << "        # fence (ignored)\n";
+            return true;
         }
 
         // ===== I-type LOAD ===== (LB/LH/LW/LBU/LHU)
         if (opc == 0x03) {
-            if (!allowMem) return std::nullopt;
-            const int32_t imm = immI();
-            const std::string addr = newTmp(), ofs = newTmp(), ptr = newTmp(), tmp = newTmp();
-
-            out << "        " << addr << " =w add " << R(rs1) << ", " << imm << "\n";
-            out << "        " << ofs  << " =w sub " << addr << ", " << MemMapV01::kRamBase << "\n";
-            out << "        " << ptr  << " =l add %ram, " << ofs << "\n";
-
+            const char* op = nullptr;
             switch (funct3) {
-                case 0x0: out << "        " << tmp  << " =w loadsb " << ptr << "\n"; SET(rd, tmp, out); return out.str(); // LB
-                case 0x1: out << "        " << tmp  << " =w loadsh " << ptr << "\n"; SET(rd, tmp, out); return out.str(); // LH
-                case 0x2: out << "        " << tmp  << " =w loadw "  << ptr << "\n"; SET(rd, tmp, out); return out.str(); // LW
-                case 0x4: out << "        " << tmp  << " =w loadub " << ptr << "\n"; SET(rd, tmp, out); return out.str(); // LBU
-                case 0x5: out << "        " << tmp  << " =w loaduh " << ptr << "\n"; SET(rd, tmp, out); return out.str(); // LHU
-                default:  return std::nullopt;
+                case 0x0: op = "loadsb"; break; // LB
+                case 0x1: op = "loadsh"; break; // LH
+                case 0x2: op = "loadw";  break; // LW
+                case 0x4: op = "loadub"; break; // LBU
+                case 0x5: op = "loaduh"; break; // LHU
+                default:  return false;
             }
+            const std::string base = R(rs1, out);
+            const std::string ptr = emitRamCheck(base, immI(), ir, pc, out);
+            const std::string tmp = newTmp();
+            out << "        " << tmp << " =w " << op << " " << ptr << "\n";
+            SET(rd, "copy " + tmp, out);
+            emitRamJoin(out);
+            return true;
         }
 
         // ===== S-type STORE ===== (SB/SH/SW)
         if (opc == 0x23) {
-            if (!allowMem) return std::nullopt;
-            const int32_t simm = immS();
-            const std::string addr = newTmp(), ofs = newTmp(), ptr = newTmp();
-
-            out << "        " << addr << " =w add " << R(rs1) << ", " << simm << "\n";
-            out << "        " << ofs  << " =w sub " << addr << ", " << MemMapV01::kRamBase << "\n";
-            out << "        " << ptr  << " =l add %ram, " << ofs << "\n";
-
+            const char* op = nullptr;
             switch (funct3) {
-                case 0x0: out << "        storeb " << R(rs2) << ", " << ptr << "\n"; return out.str(); // SB
-                case 0x1: out << "        storeh " << R(rs2) << ", " << ptr << "\n"; return out.str(); // SH
-                case 0x2: out << "        storew " << R(rs2) << ", " << ptr << "\n"; return out.str(); // SW
-                default:  return std::nullopt;
+                case 0x0: op = "storeb"; break; // SB
+                case 0x1: op = "storeh"; break; // SH
+                case 0x2: op = "storew"; break; // SW
+                default:  return false;
             }
+            const std::string base = R(rs1, out);
+            const std::string val  = R(rs2, out);   // 必须在分支前加载, 保证两条路径上都有定义
+            const std::string ptr = emitRamCheck(base, immS(), ir, pc, out);
+            out << "        " << op << " " << val << ", " << ptr << "\n";
+            emitRamJoin(out);
+            return true;
         }
 
-        // ===== Op-imm / Op（算术逻辑，非乘除） =====
+        // ===== Op-imm / Op（算术逻辑） =====
         if (opc == 0x13 || opc == 0x33) {
             const bool is_reg = (opc == 0x33);       // 0x33: reg op, 0x13: imm op
-            const int32_t imm = immI();
-            const std::string rhs = is_reg ? R(rs2) : std::to_string(imm);
 
-            // RV32M（乘除）在 v01 交回解释器
-            if (is_reg && (funct7 & 0x20)) return std::nullopt;
+            // RV32M: 只有 MUL 语义与 QBE 一致, 其余(除零/溢出规则)交给 helper
+            if (is_reg && (funct7 & 0x01)) {
+                if (funct3 != 0) return false;
+                const std::string a = R(rs1, out), b = R(rs2, out);
+                SET(rd, "mul " + a + ", " + b, out);
+                return true;
+            }
 
-            switch (funct3) {
-                case 0x0: { // ADD/SUB or ADDI
-                    if (is_reg && (funct7 & 0x20)) return std::nullopt; // SUB 已处理
-                    SET(rd, std::string("add ") + R(rs1) + ", " + rhs, out);
-                    return out.str();
+            const std::string a = R(rs1, out);
+            std::string rhs;
+            if (is_reg) {
+                rhs = R(rs2, out);
+                if (funct3 == 0x1 || funct3 == 0x5) {   // 移位量只取低 5 位
+                    const std::string sh = newTmp();
+                    out << "        " << sh << " =w and " << rhs << ", 31\n";
+                    rhs = sh;
                 }
+            } else {
+                const int32_t imm = immI();
+                rhs = std::to_string((funct3 == 0x1 || funct3 == 0x5) ? (imm & 0x1F) : imm);
+            }
+
+            switch (funct3) {
+                case 0x0:  // ADD/SUB or ADDI
+                    SET(rd, std::string((is_reg && (funct7 & 0x20)) ? "sub " : "add ") + a + ", " + rhs, out); return true;
                 case 0x1:  // SLL / SLLI
-                    SET(rd, std::string("shl ") + R(rs1) + ", " + rhs, out); return out.str();
+                    SET(rd, "shl " + a + ", " + rhs, out); return true;
                 case 0x2:  // SLT / SLTI
-                    SET(rd, std::string("cslt ") + R(rs1) + ", " + rhs, out); return out.str();
+                    SET(rd, "csltw " + a + ", " + rhs, out); return true;
                 case 0x3:  // SLTU / SLTIU
-                    SET(rd, std::string("csltu ") + R(rs1) + ", " + rhs, out); return out.str();
+                    SET(rd, "cultw " + a + ", " + rhs, out); return true;
                 case 0x4:  // XOR / XORI
-                    SET(rd, std::string("xor ") + R(rs1) + ", " + rhs, out); return out.str();
+                    SET(rd, "xor " + a + ", " + rhs, out); return true;
                 case 0x5:  // SRL/SRA or SRLI/SRAI
-                    if (is_reg) {
-                        // srl/sra 需根据 funct7 决定：这里 v01 统一用 srl；sra 交回解释器或自行扩展
-                        if (funct7 & 0x20) return std::nullopt; // SRA/SRAI 交回
-                        SET(rd, std::string("shr ") + R(rs1) + ", " + rhs, out); return out.str();
-                    } else {
-                        if (funct7 & 0x20) return std::nullopt; // SRAI 交回
-                        SET(rd, std::string("shr ") + R(rs1) + ", " + rhs, out); return out.str();
-                    }
+                    SET(rd, std::string((funct7 & 0x20) ? "sar " : "shr ") + a + ", " + rhs, out); return true;
                 case 0x6:  // OR / ORI
-                    SET(rd, std::string("or ") + R(rs1) + ", " + rhs, out); return out.str();
+                    SET(rd, "or " + a + ", " + rhs, out); return true;
                 case 0x7:  // AND / ANDI
-                    SET(rd, std::string("and ") + R(rs1) + ", " + rhs, out); return out.str();
-                default:
-                    return std::nullopt;
+                    SET(rd, "and " + a + ", " + rhs, out); return true;
             }
         }
 
-        // 其它暂不支持
-        return std::nullopt;
+        // 其它(CSR / AMO / MULH / DIV ...) 交给 helper
+        return false;
     }
 
-    void commit(const std::string& piece) {
-        if (!piece.empty()) {
-            ss_ << piece;
-            if (piece.back() != '\n') ss_ << "\n"; // 保障换行，避免下一句粘连
+    // 读寄存器：x0 恒为 0；其它寄存器第一次使用时从 state 加载到 %xN
+    std::string R(int x, std::ostringstream& out) {
+        if (x == 0) return "0";
+        if (!(cached_ & (1u << x))) {
+            emitLoadReg(x, out);
+            cached_ |= 1u << x;
         }
+        return "%x" + std::to_string(x);
     }
 
-    std::string finalize() {
-        ss_ << "        ret %pc_in\n";
-        ss_ << "}\n";
-        return ss_.str();
+    // 写寄存器：x0 写入丢弃，输出注释；否则生成 "%xN =w <expr>"
+    void SET(int rdd, const std::string& expr, std::ostringstream& out) {
+        if (rdd == 0) {
+            out << "        # x0 <- " << expr << " (ignored)\n";
+        } else {
+            out << "        %x" << rdd << " =w " << expr << "\n";
+            cached_ |= 1u << rdd;
+            dirty_  |= 1u << rdd;
+        }
+    }
+
+    // 只写回 dirty 的寄存器; keep_dirty 用于分支一侧的写回(汇合后另一侧仍然是 dirty)
+    void spillDirty(std::ostringstream& out, bool keep_dirty) {
+        for (int x = 1; x < 32; x++) {
+            if (!(dirty_ & (1u << x))) continue;
+            const std::string a = newTmp();
+            out << "        " << a << " =l add %state, " << 4 * x << "\n";
+            out << "        storew %x" << x << ", " << a << "\n";
+        }
+        if (!keep_dirty) dirty_ = 0;
+    }
+
+    void emitLoadReg(int x, std::ostringstream& out) {
+        if (x == 0) return;
+        const std::string a = newTmp();
+        out << "        " << a << " =l add %state, " << 4 * x << "\n";
+        out << "        %x" << x << " =w loadw " << a << "\n";
+    }
+
+    // helper 可能改写 rd, 之后重新从 state 加载
+    void reload(int rd, std::ostringstream& out) {
+        if (rd == 0) return;
+        emitLoadReg(rd, out);
+        cached_ |= 1u << rd;
+        dirty_  &= ~(1u << rd);
+    }
+
+    // 调用 helper 并在失败时离开块; 成功后落到 @cN 继续
+    void emitHelperCall(uint32_t ir, uint32_t pc, bool keep_dirty, std::ostringstream& out) {
+        spillDirty(out, keep_dirty);
+        const std::string r = newTmp();
+        out << "        " << r << " =w call %helper(l %state, l %ram, w " << (int32_t)pc << ", w " << (int32_t)ir << ")\n";
+        out << "        jnz " << r << ", @x" << count_ << ", @c" << count_ << "\n";
+        out << "@x" << count_ << "\n";
+        out << "        ret " << count_ << "\n";
+        out << "@c" << count_ << "\n";
+    }
+
+    void emitHelper(uint32_t ir, uint32_t pc) {
+        const uint32_t opc = ir & 0x7F;
+        const int rd = (opc == 0x23) ? 0 : (int)((ir >> 7) & 0x1F);
+        ss_ << "        # helper " << std::hex << ir << std::dec << "\n";
+        emitHelperCall(ir, pc, false, ss_);
+        reload(rd, ss_);
+    }
+
+    // 访存快路径: 地址落在 RAM 内则直接访问 %ram, 否则走 helper(MMIO / 访问异常)
+    // store 还要查 codePages_: 写到有块的页(可能就是本块)时也走 helper, 由解释器写入并让这些块失效
+    // 返回快路径上的主机指针临时变量; 调用方随后写快路径代码, 再调用 emitRamJoin
+    std::string emitRamCheck(const std::string& base, int32_t imm, uint32_t ir, uint32_t pc, std::ostringstream& out) {
+        const std::string addr = newTmp(), ofs = newTmp(), ok = newTmp(), ofsl = newTmp(), ptr = newTmp();
+        out << "        " << addr << " =w add " << base << ", " << imm << "\n";
+        out << "        " << ofs  << " =w sub " << addr << ", " << MemMapV01::kRamBase << "\n";
+        out << "        " << ok   << " =w cultw " << ofs << ", " << (ramSize_ - 3) << "\n";
+        out << "        jnz " << ok << ", @f" << count_ << ", @s" << count_ << "\n";
+        out << "@s" << count_ << "\n";
+        emitHelperCall(ir, pc, true, out);
+        if ((ir & 0x7F) == 0x03)    // 慢路径上 rd 由 helper 写入 state, 重新加载到同一个 %xN
+            emitLoadReg((int)((ir >> 7) & 0x1F), out);
+        out << "        jmp @j" << count_ << "\n";
+        out << "@f" << count_ << "\n";
+        out << "        " << ofsl << " =l extuw " << ofs << "\n";
+        if ((ir & 0x7F) == 0x23 && codePages_) {
+            const std::string last = newTmp(), p0 = newTmp(), p1 = newTmp(), a0 = newTmp(), a1 = newTmp(), c0 = newTmp(), c1 = newTmp(), hit = newTmp();
+            out << "        " << last << " =l add " << ofsl << ", " << ((1 << ((ir >> 12) & 0x3)) - 1) << "\n";
+            out << "        " << p0 << " =l shr " << ofsl << ", 12\n";
+            out << "        " << p1 << " =l shr " << last << ", 12\n";
+            out << "        " << a0 << " =l add " << (uint64_t)(uintptr_t)codePages_ << ", " << p0 << "\n";
+            out << "        " << a1 << " =l add " << (uint64_t)(uintptr_t)codePages_ << ", " << p1 << "\n";
+            out << "        " << c0 << " =w loadub " << a0 << "\n";
+            out << "        " << c1 << " =w loadub " << a1 << "\n";
+            out << "        " << hit << " =w or " << c0 << ", " << c1 << "\n";
+            out << "        jnz " << hit << ", @s" << count_ << ", @w" << count_ << "\n";
+            out << "@w" << count_ << "\n";
+        }
+        out << "        " << ptr  << " =l add %ram, " << ofsl << "\n";
+        return ptr;
+    }
+
+    void emitRamJoin(std::ostringstream& out) {
+        out << "@j" << count_ << "\n";
     }
 
-private:
     std::string newTmp() { return std::string("%t") + std::to_string(tmpId_++); }
-    void reset() { func_.clear(); ss_.str(""); ss_.clear(); tmpId_ = 0; }
+    void reset() {
+        func_.clear(); ss_.str(""); ss_.clear(); tmpId_ = 0;
+        pc_ = 0; count_ = 0; cached_ = 0; dirty_ = 0;
+    }
 
 private:
     std::string        func_;
     std::ostringstream ss_;
     int                tmpId_ = 0;
+    uint32_t           pc_ = 0;         // 块首 pc
+    uint32_t           ramSize_ = 0;    // MINI_RV32_RAM_SIZE, 翻译时固化进代码
+    const uint8_t*     codePages_ = nullptr;    // 有块的页, 地址固化进代码 (.so 加载在同一个进程里)
+    int                count_ = 0;      // 已追加的指令条数
+    uint32_t           cached_ = 0;     // bit x: %xN 已持有 regs[x]
+    uint32_t           dirty_ = 0;      // bit x: %xN 比 state->regs[x] 新
 };
 
 #endif //MY_MINI_RV32IMA_RV32I_QBE_TRANS_V01_H